@@ -0,0 +1,330 @@
+/*
+ ** Pretty6502 benchmark
+ **
+ ** by Oscar Toledo G.
+ **
+ ** © Copyright 2017-2026 Oscar Toledo G.
+ **
+ ** Creation date: Oct/17/2026. Throughput for each processor and option set
+ **                             over a synthetic source, compared against a
+ **                             baseline file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pretty6502.h"
+
+#define TOLERANCE   25      /* Percentage allowed below baseline (BENCH_TOLERANCE) */
+
+/*
+ ** Words used to generate the source of each processor
+ */
+struct vocabulary {
+    char *name;
+    char *mnemonics[8];
+    char *if_directive;
+    char *else_directive;
+    char *endif_directive;
+    char *equ_directive;
+    char *data_directive;
+} vocabularies[] = {
+    {"unknown", {"lda", "sta", "ld", "mov", "jsr", "call", "add", "ret"}, "if", "else", "endif", "equ", "db"},
+    {"6502_dasm", {"lda", "sta", "ldx", "jsr", "rts", "bne", "inc", "adc"}, "if", "else", "endif", "equ", ".byte"},
+    {"z80_tniasm", {"ld", "ex", "call", "ret", "jp", "push", "djnz", "add"}, "if", "else", "endif", "equ", "db"},
+    {"cp1610_as1600", {"mvii", "mvo", "mvi@", "addr", "b", "jsr", "decr", "nop"}, "if", "else", "endi", "equ", "decle"},
+    {"tms9900_xas99", {"li", "mov", "movb", "bl", "jmp", "ai", "clr", "rt"}, ".ifdef", ".else", ".endif", "equ", "byte"},
+    {"8086_nasm", {"mov", "add", "int", "jmp", "call", "push", "ret", "xor"}, "%if", "%else", "%endif", "equ", "db"},
+    {"65c02_ca65", {"lda", "sta", "stz", "bra", "phx", "jsr", "rts", "inc"}, ".if", ".else", ".endif", "=", ".byte"},
+    {"6502_gasm80", {"lda", "sta", "ldx", "jsr", "rts", "bne", "inc", "adc"}, "if", "else", "endif", "equ", "db"},
+    {"z80_gasm80", {"ld", "ex", "call", "ret", "jp", "push", "djnz", "add"}, "if", "else", "endif", "equ", "db"},
+};
+
+/*
+ ** Option sets measured
+ */
+struct option_set {
+    char *name;
+    int style;
+    int tabs;
+    int labels_own_line;
+    int change_case;
+} option_sets[] = {
+    {"default", 0, 0, 0, 0},
+    {"s1_t8", 1, 8, 0, 0},
+    {"l_mu_du", 0, 0, 1, 1},
+};
+
+/*
+ ** Deterministic random numbers
+ */
+unsigned int seed;
+
+unsigned int random_number(unsigned int range)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed % range;
+}
+
+/*
+ ** Generate a source file of the given size for a processor, the
+ ** last line can end a bit after size (the real length is returned)
+ */
+char *generate(int processor, size_t size, size_t *length, size_t *lines)
+{
+    struct vocabulary *v = &vocabularies[processor];
+    static char *operands[] = {
+        "#$20", "table,x", "(ptr),y", "hl,(ix+5)", "r1,*r2", "[bx+si],ax",
+        "\"Hello, world; not a comment\"", "'A'", "label+3", "$c000",
+    };
+    static char *comments[] = {
+        "; Update pointer", "; Wait for vertical blank", "; Next",
+        "; Set up registers for the loop",
+    };
+    char *data;
+    char *p;
+    char line[256];
+    int level;
+    int label;
+    int r;
+    
+    data = malloc(size + 256);
+    if (data == NULL) {
+        fprintf(stderr, "Unable to allocate memory\n");
+        exit(1);
+    }
+    seed = 0x6502 + processor;
+    p = data;
+    level = 0;
+    label = 0;
+    *lines = 0;
+    while (p < data + size) {
+        r = random_number(100);
+        if (r < 5) {
+            line[0] = '\0';
+        } else if (r < 12) {
+            sprintf(line, "%*s%s", (int) random_number(3) * 8, "", comments[random_number(4)]);
+        } else if (r < 16 && level < 4) {
+            sprintf(line, "\t%s DEBUG", v->if_directive);
+            level++;
+        } else if (r < 18 && level > 0) {
+            sprintf(line, "\t%s", v->else_directive);
+        } else if (r < 22 && level > 0) {
+            sprintf(line, "\t%s", v->endif_directive);
+            level--;
+        } else if (r < 26) {
+            sprintf(line, "CONST%d %s %d", label++, v->equ_directive, (int) random_number(256));
+        } else if (r < 34) {
+            sprintf(line, "\t%s %s,%s\t%s", v->data_directive, operands[6], operands[7], comments[random_number(4)]);
+        } else {
+            sprintf(line, "%s\t%s %s%s%s",
+                    random_number(4) == 0 ? "loop" : "",
+                    v->mnemonics[random_number(8)],
+                    operands[random_number(10)],
+                    random_number(3) == 0 ? "   " : "",
+                    random_number(2) == 0 ? comments[random_number(4)] : "");
+        }
+        strcpy(p, line);
+        p += strlen(line);
+        *p++ = '\n';
+        (*lines)++;
+    }
+    *length = p - data;
+    return data;
+}
+
+/*
+ ** Sink that only counts
+ */
+int discard(void *context, char *data, size_t length)
+{
+    (void) data;
+    *(size_t *) context += length;
+    return 0;
+}
+
+/*
+ ** Current time in seconds
+ */
+double now(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ ** Parse a size like 1K, 16M, or 1G
+ */
+size_t parse_size(char *p)
+{
+    char *p2;
+    size_t size;
+    
+    size = strtoul(p, &p2, 10);
+    if (*p2 == 'K' || *p2 == 'k')
+        size *= 1024;
+    else if (*p2 == 'M' || *p2 == 'm')
+        size *= 1024 * 1024;
+    else if (*p2 == 'G' || *p2 == 'g')
+        size *= 1024 * 1024 * 1024;
+    return size;
+}
+
+/*
+ ** Look for the baseline of a measure, zero if none
+ */
+double find_baseline(FILE *baseline, char *name)
+{
+    char line[256];
+    char key[128];
+    double value;
+    
+    if (baseline == NULL)
+        return 0;
+    rewind(baseline);
+    while (fgets(line, sizeof(line), baseline) != NULL) {
+        if (sscanf(line, "%127s %lf", key, &value) == 2 && strcmp(key, name) == 0)
+            return value;
+    }
+    return 0;
+}
+
+/*
+ ** Main program
+ */
+int main(int argc, char *argv[])
+{
+    struct pretty6502_options options;
+    char *sizes;
+    char *list;
+    char *p;
+    char name[128];
+    char message[256];
+    FILE *baseline;
+    FILE *save;
+    char *data;
+    size_t size;
+    size_t length;
+    size_t lines;
+    size_t written;
+    double start;
+    double elapsed;
+    double best;
+    double speed;
+    double expected;
+    int processor;
+    int set;
+    int runs;
+    int regressions;
+    int tolerance;
+    
+    if (argc < 2) {
+        fprintf(stderr, "Usage: benchmark baseline.txt [--save]\n");
+        fprintf(stderr, "Sizes are taken from BENCH_SIZES (default \"1K 64K 1M 16M\", up to 1G)\n");
+        fprintf(stderr, "Allowed slowdown is taken from BENCH_TOLERANCE (default %d%%)\n", TOLERANCE);
+        exit(1);
+    }
+    baseline = NULL;
+    save = NULL;
+    if (argc > 2 && strcmp(argv[2], "--save") == 0) {
+        save = fopen(argv[1], "w");
+        if (save == NULL) {
+            fprintf(stderr, "Unable to create baseline: %s\n", argv[1]);
+            exit(1);
+        }
+        fprintf(save, "# Pretty6502 benchmark baseline (MB/s), regenerate with make bench-baseline\n");
+    } else {
+        baseline = fopen(argv[1], "r");
+        if (baseline == NULL)
+            fprintf(stderr, "No baseline in %s, make bench-baseline records one for this machine\n", argv[1]);
+    }
+    sizes = getenv("BENCH_SIZES");
+    if (sizes == NULL)
+        sizes = "1K 64K 1M 16M";
+    list = strdup(sizes);
+    tolerance = TOLERANCE;
+    if (getenv("BENCH_TOLERANCE") != NULL)
+        tolerance = atoi(getenv("BENCH_TOLERANCE"));
+    regressions = 0;
+    printf("%-36s %10s %14s %10s\n", "benchmark", "MB/s", "lines/s", "baseline");
+    for (p = strtok(list, " "); p != NULL; p = strtok(NULL, " ")) {
+        size = parse_size(p);
+        if (size == 0)
+            continue;
+        for (processor = P_UNK; processor < P_UNSUPPORTED; processor++) {
+            data = generate(processor, size, &length, &lines);
+            for (set = 0; set < (int) (sizeof(option_sets) / sizeof(option_sets[0])); set++) {
+                pretty6502_defaults(&options);
+                options.processor = processor;
+                options.style = option_sets[set].style;
+                options.tabs = option_sets[set].tabs;
+                options.labels_own_line = option_sets[set].labels_own_line;
+                if (option_sets[set].change_case) {
+                    options.mnemonics_case = 2;
+                    options.directives_case = 2;
+                }
+                if (options.tabs != 0)
+                    options.nesting_space = options.tabs;
+                if (pretty6502_check(&options, message)) {
+                    fprintf(stderr, "%s\n", message);
+                    exit(1);
+                }
+                
+                sprintf(name, "%s/%s/%s", vocabularies[processor].name, option_sets[set].name, p);
+                
+                /*
+                 ** Best of several runs (at least 0.2 seconds)
+                 */
+                best = 1e30;
+                runs = 0;
+                start = now();
+                do {
+                    written = 0;
+                    elapsed = now();
+                    if (pretty6502_format(&options, data, length, discard, &written)) {
+                        fprintf(stderr, "Unable to format %s\n", name);
+                        exit(1);
+                    }
+                    elapsed = now() - elapsed;
+                    if (elapsed < best)
+                        best = elapsed;
+                    runs++;
+                } while (runs < 3 || (now() - start < 0.2 && runs < 10000));
+                if (best <= 0)
+                    best = 1e-9;
+                speed = length / best / 1048576.0;
+                if (save != NULL) {
+                    fprintf(save, "%s %.1f\n", name, speed);
+                    printf("%-36s %10.1f %14.0f\n", name, speed, lines / best);
+                    continue;
+                }
+                expected = find_baseline(baseline, name);
+                if (expected == 0) {
+                    printf("%-36s %10.1f %14.0f %10s\n", name, speed, lines / best, "-");
+                } else {
+                    printf("%-36s %10.1f %14.0f %10.1f%s\n", name, speed, lines / best, expected,
+                           speed < expected * (100 - tolerance) / 100 ? "  REGRESSION" : "");
+                    if (speed < expected * (100 - tolerance) / 100)
+                        regressions++;
+                }
+            }
+            free(data);
+        }
+    }
+    free(list);
+    if (save != NULL)
+        fclose(save);
+    if (baseline != NULL)
+        fclose(baseline);
+    if (regressions) {
+        printf("%d regressions (more than %d%% below baseline)\n", regressions, tolerance);
+        exit(1);
+    }
+    exit(0);
+}
@@ -3,7 +3,7 @@
  **
  ** by Oscar Toledo G.
  **
- ** © Copyright 2017-2025 Oscar Toledo G.
+ ** © Copyright 2017-2026 Oscar Toledo G.
  **
  ** Creation date: Nov/03/2017.
  ** Revision date: Nov/06/2017. Processor selection. Indents nested IF/ENDIF.
@@ -21,34 +21,125 @@
  ** Revision date: May/04/2020. Adjusted CP1610 for indenting REPEAT directive.
  ** Revision date: Apr/12/2021. Added support for 8086 + nasm.
  ** Revision date: Feb/03/2025. Added support for 6502+Z80 / gasm80.
+ ** Revision date: Oct/17/2026. Keywords are searched through a hash index built
+ **                             once per processor.
+ ** Revision date: Oct/17/2026. Added batch mode to format trees in parallel.
+ ** Revision date: Oct/17/2026. Streaming from standard input to standard output.
+ ** Revision date: Oct/17/2026. Input file is mapped in memory and never modified.
+ ** Revision date: Oct/17/2026. Output is collected in a buffer written in big blocks.
+ ** Revision date: Oct/17/2026. Formatter available as a reentrant library.
+ ** Revision date: Oct/17/2026. Added --lines to format a range of lines.
+ ** Revision date: Oct/17/2026. Added --check to verify files are formatted.
+ ** Revision date: Oct/17/2026. Added --cache to skip files already formatted.
+ ** Revision date: Oct/17/2026. Lines are indexed 16/32 bytes at a time (SSE2/AVX2).
+ ** Revision date: Oct/17/2026. Fields are scanned with a character class table
+ **                             per processor instead of isspace() per byte.
+ ** Revision date: Oct/17/2026. Line formatting specialized for each kind of
+ **                             processor, selected once.
+ ** Revision date: Oct/17/2026. Custom dialects compiled from text definitions.
+ ** Revision date: Oct/17/2026. Big files are formatted in parts at the same time.
+ ** Revision date: Oct/17/2026. Added --daemon and --connect to format through a
+ **                             long-running process.
+ ** Revision date: Oct/17/2026. Files formatted in place are replaced atomically,
+ **                             and only if changed.
+ ** Revision date: Oct/17/2026. Added --follow to format the files included.
+ ** Revision date: Oct/17/2026. Added --stats, counters of hot paths with make stats.
+ ** Revision date: Oct/17/2026. Added --diff to show the changes as unified diff.
+ ** Revision date: Oct/17/2026. Added --tokens to write the fields as binary records.
+ ** Revision date: Oct/17/2026. Operands jump over strings, with the rules for
+ **                             apostrophes of each processor.
+ ** Revision date: Oct/17/2026. Added --xref to write a label cross-reference.
+ ** Revision date: Oct/17/2026. Added --watch to format the files when saved.
+ ** Revision date: Oct/17/2026. Added --variant to write several layouts splitting
+ **                             the lines only once.
  */
 
+#define _FILE_OFFSET_BITS 64
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-#define VERSION "v0.9"
+#include "pretty6502.h"
 
-int tabs;           /* Size of tabs (0 to use spaces) */
+#define VERSION "v0.9"
 
+/*
+ ** Statistics
+ **
+ ** Counters of the hot paths, only compiled with PRETTY6502_STATS
+ ** (make stats), otherwise STAT() is nothing at all. Each line counts
+ ** once, when it is formatted, the other passes over the same lines
+ ** (nesting of parallel parts, joining of parts, lines before --lines,
+ ** cross-reference, tokens, and includes) are under STAT_PRESCAN().
+ */
 enum {
-    P_UNK,
-    P_6502,
-    P_Z80,
-    P_CP1610,
-    P_TMS9900,
-    P_8086,
-    P_65C02,
-    P_6502_GASM80,
-    P_Z80_GASM80,
-    P_UNSUPPORTED,
-} processor;        /* Processor/assembler being used (0-4) */
+    LINE_EMPTY,
+    LINE_COMMENT,
+    LINE_LABEL,     /* Only label */
+    LINE_MNEMONIC,
+    LINE_DIRECTIVE,
+    LINE_UNKNOWN,   /* Mnemonic not found */
+    LINE_TYPES,
+};
+
+#ifdef PRETTY6502_STATS
+static struct statistics {
+    unsigned long long directives;  /* Opcode searches by result */
+    unsigned long long mnemonics;
+    unsigned long long unknown;
+    unsigned long long comparisons; /* Keywords compared in index */
+    unsigned long long comments;    /* comment_present() evaluations */
+    unsigned long long lines[LINE_TYPES];
+    unsigned long long normalize;   /* Nanoseconds indexing and preparing lines */
+} statistics;
+static __thread int statistics_prescan; /* Nonzero while this thread is prescanning */
+
+#define STAT(counter)   STAT_ADD(counter, 1)
+#define STAT_ADD(counter, value)    do { if (!statistics_prescan) __atomic_fetch_add(&statistics.counter, (value), __ATOMIC_RELAXED); } while (0)
+#define STAT_PRESCAN(on)    (statistics_prescan = (on))
+#else
+#define STAT(counter)   ((void) 0)
+#define STAT_ADD(counter, value)    ((void) 0)
+#define STAT_PRESCAN(on)    ((void) 0)
+#endif
+
+/*
+ ** Monotonic clock in nanoseconds
+ */
+static inline unsigned long long clock_nanoseconds(void)
+{
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
 
 /*
  ** 65C02 mnemonics
  */
-char *mnemonics_65C02[] = {
+static char *mnemonics_65C02[] = {
     "adc" ,"and" ,"asl" ,"bbr0","bbr1","bbr2","bbr3","bbr4",
     "bbr5","bbr6","bbr7","bbs0","bbs1","bbs2","bbs3","bbs4",
     "bbs5","bbs6","bbs7","bcc" ,"bcs" ,"beq" ,"bit" ,"bmi" ,
@@ -67,7 +158,7 @@ char *mnemonics_65C02[] = {
 /*
  ** 65C02 mnemonics
  */
-char *mnemonics_6502[] = {
+static char *mnemonics_6502[] = {
     "adc", "anc", "and", "ane", "arr", "asl", "asr", "bcc",
     "bcs", "beq", "bit", "bmi", "bne", "bpl", "brk", "bvc",
     "bvs", "clc", "cld", "cli", "clv", "cmp", "cpx", "cpy",
@@ -83,7 +174,7 @@ char *mnemonics_6502[] = {
 /*
  ** Z80 mnemonics
  */
-char *mnemonics_z80[] = {
+static char *mnemonics_z80[] = {
     "adc",  "add",  "and",  "bit",  "call", "ccf",  "cp",   "cpd",
     "cpdr", "cpi",  "cpir", "cpl",  "daa",  "dec",  "di",   "djnz",
     "ei",   "ex",   "exx",  "halt", "im",   "in",   "inc",  "ind",
@@ -98,7 +189,7 @@ char *mnemonics_z80[] = {
 /*
  ** CP1610 mnemonics
  */
-char *mnemonics_cp1610[] = {
+static char *mnemonics_cp1610[] = {
     "adcr", "add",  "add@", "addi", "addr", "and",  "and@", "andi",
     "andr", "b",    "bc",   "beq",  "besc", "bext", "bge",  "bgt",
     "ble",  "blge", "bllt", "blt",  "bmi",  "bnc",  "bneq", "bnov",
@@ -115,7 +206,7 @@ char *mnemonics_cp1610[] = {
 /*
  ** TMS9900 mnemonics
  */
-char *mnemonics_tms9900[] = {
+static char *mnemonics_tms9900[] = {
     "a",    "ab",   "abs",  "ai",   "andi", "b",    "bl",   "blwp",
     "c",    "call", "cb",   "ci",   "ckof", "ckon", "clr",  "coc",
     "czc",  "dec",  "dect", "div",  "idle", "inc",  "inct", "inv",
@@ -131,7 +222,7 @@ char *mnemonics_tms9900[] = {
 /*
  ** 8086 mnemonics
  */
-char *mnemonics_8086[] = {
+static char *mnemonics_8086[] = {
     "aaa",  "aad",  "aam",  "aas",  "adc",  "add",  "and",  "call",
     "cbw",  "clc",  "cld",  "cli",  "cmc",  "cmp",  "cmps", "cmpsb",
     "cmpsw","cs",   "cwd",  "daa",  "das",  "dec",  "div",  "ds",
@@ -152,6 +243,7 @@ char *mnemonics_8086[] = {
 #define LEVEL_IN		0x02
 #define LEVEL_OUT		0x04
 #define LEVEL_MINUS		0x08
+#define INCLUDE_FILE		0x10	/* Operand names a source file */
 
 struct directive {
     char *directive;
@@ -161,7 +253,7 @@ struct directive {
 /*
  ** DASM directives
  */
-struct directive directives_dasm[] = {
+static struct directive directives_dasm[] = {
     "=",		DONT_RELOCATE_LABEL,
     "align",	0,
     "byte",		0,
@@ -183,7 +275,7 @@ struct directive directives_dasm[] = {
     "ifnconst",	LEVEL_IN,
     "incbin",	0,
     "incdir",	0,
-    "include",	0,
+    "include",	INCLUDE_FILE,
     "list",		0,
     "long",		0,
     "mac",		LEVEL_IN,
@@ -205,7 +297,7 @@ struct directive directives_dasm[] = {
 /*
  ** CA65 (https://cc65.github.io/doc/ca65.html) directives
  */
-struct directive directives_ca65[] = {
+static struct directive directives_ca65[] = {
     "*",            DONT_RELOCATE_LABEL,
     ".asize",       0,
     ".cpu",         0,
@@ -315,7 +407,7 @@ struct directive directives_ca65[] = {
     ".import",      0,
     ".importzp",    0,
     ".incbin",      0,
-    ".include",     0,
+    ".include",     INCLUDE_FILE,
     ".interruptor", 0,
     ".linecont",    0,
     ".list",        0,
@@ -373,7 +465,7 @@ struct directive directives_ca65[] = {
 /*
  ** tniASM directives
  */
-struct directive directives_tniasm[] = {
+static struct directive directives_tniasm[] = {
     "cpu",      0,
     "db",       0,
     "dc",       0,
@@ -389,7 +481,7 @@ struct directive directives_tniasm[] = {
     "ifdef",	LEVEL_IN,
     "ifexist",	LEVEL_IN,
     "incbin",   0,
-    "include",  0,
+    "include",  INCLUDE_FILE,
     "org",      0,
     "phase",    0,
     "rb",       0,
@@ -400,7 +492,7 @@ struct directive directives_tniasm[] = {
 /*
  ** as1600 directives
  */
-struct directive directives_as1600[] = {
+static struct directive directives_as1600[] = {
     "begin",    0,
     "bidecle",  0,
     "byte",     0,
@@ -444,7 +536,7 @@ struct directive directives_as1600[] = {
 /*
  ** xas99 directives
  */
-struct directive directives_xas99[] = {
+static struct directive directives_xas99[] = {
     ".defm",    LEVEL_IN,
     ".else",    LEVEL_MINUS,
     ".endif",   LEVEL_OUT,
@@ -462,7 +554,7 @@ struct directive directives_xas99[] = {
     "bss",      0,
     "byte",     0,
     "cend",     0,
-    "copy",     0,
+    "copy",     INCLUDE_FILE,
     "cseg",     0,
     "data",     0,
     "def",      DONT_RELOCATE_LABEL,
@@ -493,7 +585,7 @@ struct directive directives_xas99[] = {
 /*
  ** nasm directives
  */
-struct directive directives_nasm[] = {
+static struct directive directives_nasm[] = {
     "%arg",     0,
     "%assign",  0,
     "%define",  0,
@@ -515,7 +607,7 @@ struct directive directives_nasm[] = {
     "%ifmacro", LEVEL_IN,
     "%ifn",     LEVEL_IN,
     "%ifndef",  LEVEL_IN,
-    "%include", 0,
+    "%include", INCLUDE_FILE,
     "%line",    0,
     "%local",   0,
     "%macro",   LEVEL_IN,
@@ -577,7 +669,7 @@ struct directive directives_nasm[] = {
 /*
  ** gasm80 directives
  */
-struct directive directives_gasm80[] = {
+static struct directive directives_gasm80[] = {
     "align",    0,
     "cpu",      0,
     "db",       0,
@@ -590,20 +682,79 @@ struct directive directives_gasm80[] = {
     "ifdef",    LEVEL_IN,
     "ifndef",   LEVEL_IN,
     "incbin",   0,
-    "include",  0,
+    "include",  INCLUDE_FILE,
     "org",      0,
     "rb",       0,
     "times",    0,
     NULL,       0,
 };
 
+/*
+ ** Character classes
+ **
+ ** One table per processor, built once and independent of locale.
+ ** Only whitespace, ';', '*', and quotes can have a class (see
+ ** skip_to_class).
+ */
+#define CLASS_SPACE     0x01    /* Whitespace */
+#define CLASS_COMMENT   0x02    /* Can start a comment, comment_present() decides */
+#define CLASS_QUOTE     0x04    /* Starts a string */
+
+static unsigned char char_classes[P_UNSUPPORTED][256];
+static unsigned char lower_case[256];
+static unsigned char upper_case[256];
+
+#define IS_SPACE(c)     (char_classes[P_UNK][(unsigned char) (c)] & CLASS_SPACE)
+#define LOWER(c)        (lower_case[(unsigned char) (c)])
+#define IS_WORD(c)      (((c) >= '0' && (c) <= '9') || (LOWER(c) >= 'a' && LOWER(c) <= 'z') || (c) == '_')
+
+/*
+ ** Rules for apostrophes in operands, besides strings between
+ ** quotes or apostrophes (a backslash escapes the closing one)
+ */
+#define LITERAL_AF_PAIR     0x01    /* AF,AF' isn't a string */
+#define LITERAL_CHAR        0x02    /* 'c is a character (DASM), unless 'word */
+#define LITERAL_AF_PRIME    0x04    /* af' in any case isn't a string (Z80) */
+
+/*
+ ** Build the character class and case tables
+ */
+static void build_classes(void)
+{
+    int processor;
+    int c;
+    
+    for (c = 0; c < 256; c++) {
+        lower_case[c] = (c >= 'A' && c <= 'Z') ? c + 32 : c;
+        upper_case[c] = (c >= 'a' && c <= 'z') ? c - 32 : c;
+    }
+    for (processor = 0; processor < P_UNSUPPORTED; processor++) {
+        char_classes[processor][' '] = CLASS_SPACE;
+        char_classes[processor]['\t'] = CLASS_SPACE;
+        char_classes[processor]['\n'] = CLASS_SPACE;
+        char_classes[processor]['\v'] = CLASS_SPACE;
+        char_classes[processor]['\f'] = CLASS_SPACE;
+        char_classes[processor]['\r'] = CLASS_SPACE;
+        char_classes[processor][';'] = CLASS_COMMENT;
+        char_classes[processor]['"'] = CLASS_QUOTE;
+        char_classes[processor]['\''] = CLASS_QUOTE;
+        if (processor == P_TMS9900) {   /* Two spaces or tab start a comment */
+            for (c = 0; c < 256; c++) {
+                if (char_classes[processor][c] & CLASS_SPACE)
+                    char_classes[processor][c] |= CLASS_COMMENT;
+            }
+            char_classes[processor]['*'] = CLASS_COMMENT;
+        }
+    }
+}
+
 /*
  ** Comparison without case
  */
-int memcmpcase(char *p1, char *p2, int size)
+static int memcmpcase(char *p1, char *p2, int size)
 {
     while (size--) {
-        if (tolower(*p1) != tolower(*p2))
+        if (LOWER(*p1) != LOWER(*p2))
             return 1;
         p1++;
         p2++;
@@ -612,175 +763,396 @@ int memcmpcase(char *p1, char *p2, int size)
 }
 
 /*
- ** Check for opcode or directive
+ ** Tables used by each processor
+ */
+static struct processor_tables {
+    struct directive *directives;
+    char **mnemonics;
+    int dot_prefix;     /* Directives accept an optional dot before them */
+    int literals;       /* LITERAL_* */
+} processor_tables[] = {
+    {NULL,              NULL,               0,  LITERAL_AF_PAIR},   /* P_UNK */
+    {directives_dasm,   mnemonics_6502,     1,  LITERAL_CHAR},      /* P_6502 */
+    {directives_tniasm, mnemonics_z80,      0,  LITERAL_AF_PRIME},  /* P_Z80 */
+    {directives_as1600, mnemonics_cp1610,   0,  LITERAL_AF_PAIR},   /* P_CP1610 */
+    {directives_xas99,  mnemonics_tms9900,  0,  LITERAL_AF_PAIR},   /* P_TMS9900 */
+    {directives_nasm,   mnemonics_8086,     0,  LITERAL_AF_PAIR},   /* P_8086 */
+    {directives_ca65,   mnemonics_65C02,    1,  LITERAL_AF_PAIR},   /* P_65C02 */
+    {directives_gasm80, mnemonics_6502,     0,  LITERAL_AF_PAIR},   /* P_6502_GASM80 */
+    {directives_gasm80, mnemonics_z80,      0,  LITERAL_AF_PRIME},  /* P_Z80_GASM80 */
+};
+
+/*
+ ** Kinds of processor with their own specialized formatting
+ **
+ ** The kernels are always inlined with the dialect as a constant,
+ ** so the code for other dialects disappears from each copy.
+ */
+#define DIALECT_UNKNOWN     0   /* No keywords */
+#define DIALECT_PLAIN       1
+#define DIALECT_DOTTED      2   /* Directives accept a dot before them */
+#define DIALECT_TMS9900     3   /* Comments start after two spaces */
+
+#ifdef __GNUC__
+#define KERNEL  static inline __attribute__((always_inline))
+#else
+#define KERNEL  static inline
+#endif
+
+/*
+ ** Dialect used for a processor
  */
-int check_opcode(char *p1, char *p2)
+static int processor_dialect(int processor)
 {
-    int c;
+    if (processor == P_UNK)
+        return DIALECT_UNKNOWN;
+    if (processor == P_TMS9900)
+        return DIALECT_TMS9900;
+    if (processor_tables[processor].dot_prefix)
+        return DIALECT_DOTTED;
+    return DIALECT_PLAIN;
+}
+
+/*
+ ** Keyword index
+ **
+ ** Open addressing hash table with the directives and mnemonics
+ ** of a dialect. The hash ignores case, so a single probe sequence
+ ** finds any keyword. Names are kept after the table and referenced
+ ** by offset, so the same layout is written by --compile-dialect
+ ** and mapped again from the file without any parsing. The indexes
+ ** of the built-in processors are built once on first use.
+ */
+#define INDEX_SIZE      1024    /* Must be a power of two */
+#define INDEX_MAGIC     "P6502IDX"
+#define INDEX_VERSION   2       /* Also detects a different byte order */
+
+struct keyword {
+    unsigned int name;  /* Offset from start of index, zero if empty */
     int length;
+    int id;             /* Same as find_opcode() result */
+    int flags;
+};
+
+struct pretty6502_dialect {
+    char magic[8];
+    unsigned int version;
+    unsigned int size;  /* Size of index including names */
+    int dialect;        /* DIALECT_* */
+    int count;          /* Keywords in the table */
+    int directives;     /* Directives added (next id) */
+    int mnemonics;      /* Mnemonics added (next id) */
+    int literals;       /* LITERAL_* */
+    struct keyword keywords[INDEX_SIZE];
+};
+
+static struct pretty6502_dialect *processor_index[P_UNSUPPORTED];
+static pthread_once_t keyword_index_once = PTHREAD_ONCE_INIT;
+
+#define KEYWORD_NAME(index, keyword)    ((char *) (index) + (keyword)->name)
+
+/*
+ ** Hash a keyword without case
+ */
+static unsigned int hash_keyword(char *p, int length)
+{
+    unsigned int hash;
     
-    if (processor == P_6502) {   /* 6502 + DASM */
-        for (c = 0; directives_dasm[c].directive != NULL; c++) {
-            length = strlen(directives_dasm[c].directive);
-            if ((*p1 == '.' && length == p2 - p1 - 1 && memcmpcase(p1 + 1, directives_dasm[c].directive, p2 - p1 - 1) == 0) || (length == p2 - p1 && memcmpcase(p1, directives_dasm[c].directive, p2 - p1) == 0)) {
-                return c + 1;
-            }
-        }
-        for (c = 0; mnemonics_6502[c] != NULL; c++) {
-            length = strlen(mnemonics_6502[c]);
-            if (length == p2 - p1 && memcmpcase(p1, mnemonics_6502[c], p2 - p1) == 0)
-                return -(c + 1);
-        }
+    hash = length;
+    while (length--) {
+        hash = (hash * 31) ^ LOWER(*p);
+        p++;
     }
-    if (processor == P_65C02) {   /* 65C02 + ca65 */
-        for (c = 0; directives_ca65[c].directive != NULL; c++) {
-            length = strlen(directives_ca65[c].directive);
-            if ((*p1 == '.' && length == p2 - p1 - 1 && memcmpcase(p1 + 1, directives_ca65[c].directive, p2 - p1 - 1) == 0) || (length == p2 - p1 && memcmpcase(p1, directives_ca65[c].directive, p2 - p1) == 0)) {
-                return c + 1;
-            }
-        }
-        for (c = 0; mnemonics_65C02[c] != NULL; c++) {
-            length = strlen(mnemonics_65C02[c]);
-            if (length == p2 - p1 && memcmpcase(p1, mnemonics_65C02[c], p2 - p1) == 0)
-                return -(c + 1);
-        }
+    return hash ^ (hash >> 7);
+}
+
+/*
+ ** Create an empty index
+ */
+static struct pretty6502_dialect *new_index(int dialect)
+{
+    struct pretty6502_dialect *index;
+    
+    index = calloc(1, sizeof(struct pretty6502_dialect));
+    if (index == NULL)
+        return NULL;
+    memcpy(index->magic, INDEX_MAGIC, sizeof(index->magic));
+    index->version = INDEX_VERSION;
+    index->size = sizeof(struct pretty6502_dialect);
+    index->dialect = dialect;
+    index->literals = LITERAL_AF_PAIR;
+    return index;
+}
+
+/*
+ ** Add a keyword to the index, the first one added wins
+ **
+ ** Directives get ids 1, 2, 3..., and mnemonics -1, -2, -3...
+ ** in the order they are added. The index can move in memory.
+ ** Returns zero if successful.
+ */
+static int add_keyword(struct pretty6502_dialect **index, char *name, int length, int directive, int flags)
+{
+    struct pretty6502_dialect *new_index;
+    struct keyword *keyword;
+    unsigned int c;
+    
+    if (directive)
+        (*index)->directives++;
+    else
+        (*index)->mnemonics++;
+    c = hash_keyword(name, length) & (INDEX_SIZE - 1);
+    while ((*index)->keywords[c].name != 0) {
+        keyword = &(*index)->keywords[c];
+        if (keyword->length == length && memcmpcase(KEYWORD_NAME(*index, keyword), name, length) == 0)
+            return 0;   /* Duplicated */
+        c = (c + 1) & (INDEX_SIZE - 1);
     }
-    if (processor == P_Z80) {   /* Z80 + tniASM */
-        for (c = 0; directives_tniasm[c].directive != NULL; c++) {
-            length = strlen(directives_tniasm[c].directive);
-            if (length == p2 - p1 && memcmpcase(p1, directives_tniasm[c].directive, p2 - p1) == 0) {
-                return c + 1;
-            }
-        }
-        for (c = 0; mnemonics_z80[c] != NULL; c++) {
-            length = strlen(mnemonics_z80[c]);
-            if (length == p2 - p1 && memcmpcase(p1, mnemonics_z80[c], p2 - p1) == 0)
-                return -(c + 1);
+    if ((*index)->count >= INDEX_SIZE / 2)  /* Keep probe sequences short */
+        return 1;
+    new_index = realloc(*index, (*index)->size + length + 1);
+    if (new_index == NULL)
+        return 1;
+    *index = new_index;
+    keyword = &new_index->keywords[c];
+    keyword->name = new_index->size;
+    keyword->length = length;
+    keyword->id = directive ? new_index->directives : -new_index->mnemonics;
+    keyword->flags = directive ? flags : 0;
+    memcpy(KEYWORD_NAME(new_index, keyword), name, length);
+    KEYWORD_NAME(new_index, keyword)[length] = '\0';
+    new_index->size += length + 1;
+    new_index->count++;
+    return 0;
+}
+
+/*
+ ** Add the keywords of a built-in processor
+ */
+static int add_processor(struct pretty6502_dialect **index, int processor)
+{
+    struct directive *directives;
+    char **mnemonics;
+    int c;
+    
+    directives = processor_tables[processor].directives;
+    mnemonics = processor_tables[processor].mnemonics;
+    (*index)->literals = processor_tables[processor].literals;
+    if (directives != NULL) {
+        for (c = 0; directives[c].directive != NULL; c++) {
+            if (add_keyword(index, directives[c].directive, strlen(directives[c].directive), 1, directives[c].flags))
+                return 1;
         }
     }
-    if (processor == P_CP1610) {   /* CP1610 + as1600 */
-        for (c = 0; directives_as1600[c].directive != NULL; c++) {
-            length = strlen(directives_as1600[c].directive);
-            if (length == p2 - p1 && memcmpcase(p1, directives_as1600[c].directive, p2 - p1) == 0) {
-                return c + 1;
-            }
-        }
-        for (c = 0; mnemonics_cp1610[c] != NULL; c++) {
-            length = strlen(mnemonics_cp1610[c]);
-            if (length == p2 - p1 && memcmpcase(p1, mnemonics_cp1610[c], p2 - p1) == 0)
-                return -(c + 1);
+    if (mnemonics != NULL) {
+        for (c = 0; mnemonics[c] != NULL; c++) {
+            if (add_keyword(index, mnemonics[c], strlen(mnemonics[c]), 0, 0))
+                return 1;
         }
     }
-    if (processor == P_TMS9900) {   /* TMS9900 + xas99 */
-        for (c = 0; directives_xas99[c].directive != NULL; c++) {
-            length = strlen(directives_xas99[c].directive);
-            if (length == p2 - p1 && memcmpcase(p1, directives_xas99[c].directive, p2 - p1) == 0) {
-                return c + 1;
-            }
-        }
-        for (c = 0; mnemonics_tms9900[c] != NULL; c++) {
-            length = strlen(mnemonics_tms9900[c]);
-            if (length == p2 - p1 && memcmpcase(p1, mnemonics_tms9900[c], p2 - p1) == 0)
-                return -(c + 1);
+    return 0;
+}
+
+/*
+ ** Build keyword index for every processor
+ **
+ ** An index left as NULL (out of memory) is reported by
+ ** pretty6502_format_lines().
+ */
+static void build_indexes(void)
+{
+    struct pretty6502_dialect *index;
+    int processor;
+    
+    build_classes();
+    for (processor = 0; processor < P_UNSUPPORTED; processor++) {
+        index = new_index(processor_dialect(processor));
+        if (index != NULL && add_processor(&index, processor)) {
+            free(index);
+            index = NULL;
         }
+        processor_index[processor] = index;
     }
-    if (processor == P_8086) {   /* 8086 + nasm */
-        for (c = 0; directives_nasm[c].directive != NULL; c++) {
-            length = strlen(directives_nasm[c].directive);
-            if (length == p2 - p1 && memcmpcase(p1, directives_nasm[c].directive, p2 - p1) == 0) {
-                return c + 1;
-            }
-        }
-        for (c = 0; mnemonics_8086[c] != NULL; c++) {
-            length = strlen(mnemonics_8086[c]);
-            if (length == p2 - p1 && memcmpcase(p1, mnemonics_8086[c], p2 - p1) == 0)
-                return -(c + 1);
-        }
+}
+
+/*
+ ** Search for a keyword in the index
+ */
+static struct keyword *find_keyword(struct pretty6502_dialect *index, char *p, int length)
+{
+    struct keyword *keyword;
+    unsigned int c;
+    
+    c = hash_keyword(p, length) & (INDEX_SIZE - 1);
+    while (index->keywords[c].name != 0) {
+        STAT(comparisons);
+        keyword = &index->keywords[c];
+        if (keyword->length == length && memcmpcase(KEYWORD_NAME(index, keyword), p, length) == 0)
+            return keyword;
+        c = (c + 1) & (INDEX_SIZE - 1);
     }
-    if (processor == P_6502_GASM80) {   /* 6502 + GASM80 */
-        for (c = 0; directives_gasm80[c].directive != NULL; c++) {
-            length = strlen(directives_gasm80[c].directive);
-            if (length == p2 - p1 && memcmpcase(p1, directives_gasm80[c].directive, p2 - p1) == 0) {
-                return c + 1;
-            }
-        }
-        for (c = 0; mnemonics_6502[c] != NULL; c++) {
-            length = strlen(mnemonics_6502[c]);
-            if (length == p2 - p1 && memcmpcase(p1, mnemonics_6502[c], p2 - p1) == 0)
-                return -(c + 1);
+    return NULL;
+}
+
+/*
+ ** Check for opcode or directive (kernel)
+ */
+KERNEL int find_opcode(struct pretty6502_dialect *index, int dialect, char *p1, char *p2, int *flags)
+{
+    struct keyword *keyword;
+    struct keyword *dotted;
+    
+    *flags = 0;
+    keyword = find_keyword(index, p1, p2 - p1);
+    if (dialect == DIALECT_DOTTED && *p1 == '.' && p2 - p1 > 1) {
+        dotted = find_keyword(index, p1 + 1, p2 - p1 - 1);
+        if (dotted != NULL && dotted->id > 0) {
+            if (keyword == NULL || keyword->id < 0 || dotted->id < keyword->id)
+                keyword = dotted;
         }
     }
-    if (processor == P_Z80_GASM80) {   /* Z80 + GASM80 */
-        for (c = 0; directives_gasm80[c].directive != NULL; c++) {
-            length = strlen(directives_gasm80[c].directive);
-            if (length == p2 - p1 && memcmpcase(p1, directives_gasm80[c].directive, p2 - p1) == 0) {
-                return c + 1;
+    if (keyword == NULL) {
+        STAT(unknown);
+        return 0;
+    }
+    if (keyword->id > 0) {
+        STAT(directives);
+        *flags = keyword->flags;
+    } else {
+        STAT(mnemonics);
+    }
+    return keyword->id;
+}
+
+/*
+ ** Output buffer
+ **
+ ** Formatted lines are collected in a big buffer that is written
+ ** with a single call once full, instead of doing several stdio
+ ** calls per line. Padding is copied from constant strings.
+ */
+#define OUTPUT_BUFFER   262144
+
+struct output {
+    pretty6502_sink sink;
+    void *context;
+    char *buffer;
+    size_t used;
+    int error;
+    int discard;    /* Only the state is wanted (lines before range) */
+};
+
+static char padding_spaces[] = "                                                                ";
+static char padding_tabs[] = "\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t";
+
+/*
+ ** Write the output buffer
+ */
+static void output_flush(struct output *output)
+{
+    if (output->used != 0 && !output->error)
+        output->error = output->sink(output->context, output->buffer, output->used);
+    output->used = 0;
+}
+
+/*
+ ** Add bytes to the output buffer
+ */
+static void output_bytes(struct output *output, char *p, size_t length)
+{
+    if (output->discard)
+        return;
+    if (output->used + length > OUTPUT_BUFFER) {
+        output_flush(output);
+        if (length > OUTPUT_BUFFER) {   /* Very long line */
+            while (length > OUTPUT_BUFFER) {
+                memcpy(output->buffer, p, OUTPUT_BUFFER);
+                output->used = OUTPUT_BUFFER;
+                output_flush(output);
+                p += OUTPUT_BUFFER;
+                length -= OUTPUT_BUFFER;
             }
         }
-        for (c = 0; mnemonics_z80[c] != NULL; c++) {
-            length = strlen(mnemonics_z80[c]);
-            if (length == p2 - p1 && memcmpcase(p1, mnemonics_z80[c], p2 - p1) == 0)
-                return -(c + 1);
-        }
     }
-    return 0;
+    memcpy(output->buffer + output->used, p, length);
+    output->used += length;
+}
+
+/*
+ ** Add a character to the output buffer
+ */
+static void output_char(struct output *output, int c)
+{
+    if (output->discard)
+        return;
+    if (output->used == OUTPUT_BUFFER)
+        output_flush(output);
+    output->buffer[output->used++] = c;
+}
+
+/*
+ ** Add padding to the output buffer
+ */
+static void output_padding(struct output *output, char *padding, int count)
+{
+    int length;
+    
+    length = strlen(padding);
+    while (count > length) {
+        output_bytes(output, padding, length);
+        count -= length;
+    }
+    output_bytes(output, padding, count);
 }
 
 /*
  ** Request space in line
  */
-void request_space(FILE *output, int *current, int new, int force)
+static void request_space(struct output *output, int tabs, int *current, int new, int force)
 {
     int base;
-    int tab;
+    int count;
     
     /*
      ** If already exceeded space...
      */
     if (*current >= new) {
         if (force == 1) {
-            fputc(' ', output);
+            output_char(output, ' ');
             (*current)++;
         } else if (force == 2 && *current != 0) {    /* TMS9900 */
-            fputc(' ', output);
-            (*current)++;
-            fputc(' ', output);
-            (*current)++;
+            output_padding(output, padding_spaces, 2);
+            *current += 2;
         }
         return;
     }
     
     /*
-     ** Advance one step at a time
+     ** Tabs advance one step at a time
      */
-    tab = 0;
-    base = *current;
-    while (1) {
-        if (tabs == 0) {
-            fprintf(output, "%*s", new - *current, "");
-            *current = new;
-        } else {
-            fputc('\t', output);
+    if (tabs != 0) {
+        count = 0;
+        while (*current < new) {
             *current = (*current + tabs) / tabs * tabs;
-            tab = 1;
-        }
-        if (*current >= new) {
-            if (force == 2) {   /* TMS9900 */
-                if (tab == 0) {
-                    if (*current != 0) {
-                        base = *current - base;
-                        if (base < 1) {
-                            fputc(' ', output);
-                            (*current)++;
-                        }
-                        if (base < 2) {
-                            fputc(' ', output);
-                            (*current)++;
-                        }
-                    }
-                }
+            count++;
+        }
+        output_padding(output, padding_tabs, count);
+        return;
+    }
+    base = *current;
+    output_padding(output, padding_spaces, new - *current);
+    *current = new;
+    if (force == 2) {   /* TMS9900 */
+        if (*current != 0) {
+            base = *current - base;
+            if (base < 1) {
+                output_char(output, ' ');
+                (*current)++;
+            }
+            if (base < 2) {
+                output_char(output, ' ');
+                (*current)++;
             }
-            return;
         }
     }
 }
@@ -788,22 +1160,25 @@ void request_space(FILE *output, int *current, int new, int force)
 /*
  ** Check for comment present
  */
-int comment_present(char *start, char *actual, int left_side)
+KERNEL int comment_present(int dialect, char *start, char *actual, char *end, int left_side)
 {
-    if (processor == P_TMS9900) {
+    STAT(comments);
+    if (actual >= end)
+        return 0;
+    if (dialect == DIALECT_TMS9900) {
         if (actual == start && *actual == '*')
             return 1;
         if (*actual == '*') {
             if (actual == start)
                 return 1;
-            if (actual == start + 1 && isspace(actual[-1]))
+            if (actual == start + 1 && IS_SPACE(actual[-1]))
                 return 1;
             if (actual >= start + 2) {
-                if (isspace(actual[-2]) && isspace(actual[-1]))
+                if (IS_SPACE(actual[-2]) && IS_SPACE(actual[-1]))
                     return 1;
             }
         }
-        if (isspace(actual[0]) && isspace(actual[1]) && !left_side)
+        if (IS_SPACE(actual[0]) && actual + 1 < end && IS_SPACE(actual[1]) && !left_side)
             return 1;
         if (actual[0] == '\t' && !left_side)
             return 1;
@@ -814,491 +1189,5232 @@ int comment_present(char *start, char *actual, int left_side)
 }
 
 /*
- ** Main program
+ ** Remove \r characters from a line and optionally trailing spaces,
+ ** returns the new length
  */
-int main(int argc, char *argv[])
+static size_t prepare_line(char *start, char *end, int trim)
 {
-    int c;
-    int style;
-    int start_mnemonic;
-    int start_operand;
-    int start_comment;
-    int align_comment;
-    int nesting_space;
-    int labels_own_line;
-    FILE *input;
-    FILE *output;
-    int allocation;
-    char *data;
-    char *p;
     char *p1;
     char *p2;
-    char *p3;
-    int current_column;
-    int request;
-    int current_level;
-    int prev_comment_original_location;
-    int prev_comment_final_location;
-    int flags;
-    int mnemonics_case;
-    int directives_case;
-    int indent;
-    int something;
-    int comment;
+    char *cr;
     
-    /*
-     ** Show usage if less than 3 arguments (program name counts as one)
-     */
-    if (argc < 3) {
-        fprintf(stderr, "\n");
-        fprintf(stderr, "Pretty6502 " VERSION " by Oscar Toledo G. http://nanochess.org/\n");
-        fprintf(stderr, "\n");
-        fprintf(stderr, "Usage:\n");
-        fprintf(stderr, "    pretty6502 [args] input.asm output.asm\n");
-        fprintf(stderr, "\n");
-        fprintf(stderr, "It's recommended to not use same output file as input,\n");
-        fprintf(stderr, "even if possible because there is a chance (0.0000001%%)\n");
-        fprintf(stderr, "that you can DAMAGE YOUR SOURCE if Pretty6502 has\n");
-        fprintf(stderr, "undiscovered bugs.\n");
-        fprintf(stderr, "\n");
-        fprintf(stderr, "Arguments:\n");
-        fprintf(stderr, "    -s0       Code in four columns (default)\n");
-        fprintf(stderr, "              label: mnemonic operand comment\n");
-        fprintf(stderr, "    -s1       Code in three columns\n");
-        fprintf(stderr, "              label: mnemonic+operand comment\n");
-        fprintf(stderr, "    -p0       Processor unknown\n");
-        fprintf(stderr, "    -p1       Processor 6502 + DASM syntax (default)\n");
-        fprintf(stderr, "    -p2       Processor Z80 + tniASM syntax\n");
-        fprintf(stderr, "    -p3       Processor CP1610 + as1600 syntax (Intellivision(tm))\n");
-        fprintf(stderr, "    -p4       Processor TMS9900 + xas99 syntax (TI-99/4A)\n");
-        fprintf(stderr, "    -p5       Processor 8086 + nasm syntax\n");
-        fprintf(stderr, "    -p6       Processor 65c02 + ca65 syntax\n");
-        fprintf(stderr, "    -p7       Processor 6502 + gasm80 syntax\n");
-        fprintf(stderr, "    -p8       Processor Z80 + gasm80 syntax\n");
-        fprintf(stderr, "    -n4       Nesting spacing (can be any number\n");
-        fprintf(stderr, "              of spaces or multiple of tab size)\n");
-        fprintf(stderr, "    -m8       Start of mnemonic column (default)\n");
-        fprintf(stderr, "    -o16      Start of operand column (default)\n");
-        fprintf(stderr, "    -c32      Start of comment column (default)\n");
-        fprintf(stderr, "    -t0       Use spaces to align (default)\n");
-        fprintf(stderr, "    -t8       Use tabs to reach column (size 8)\n");
-        fprintf(stderr, "              Options -m, -o, -c, and -n must be multiples of this value.\n");
-        fprintf(stderr, "    -a0       Align comments to nearest column\n");
-        fprintf(stderr, "    -a1       Comments at line start are aligned\n");
-        fprintf(stderr, "              to mnemonic (default)\n");
-        fprintf(stderr, "    -l        Puts labels in its own line\n");
-        fprintf(stderr, "    -dl       Change directives to lowercase\n");
-        fprintf(stderr, "    -du       Change directives to uppercase\n");
-        fprintf(stderr, "    -ml       Change mnemonics to lowercase\n");
-        fprintf(stderr, "    -mu       Change mnemonics to uppercase\n");
-        fprintf(stderr, "\n");
-        fprintf(stderr, "Assumes all your labels are at start of line and there is space\n");
-        fprintf(stderr, "before mnemonic.\n");
-        fprintf(stderr, "\n");
-        fprintf(stderr, "Accepts any assembler file where ; means comment\n");
-        fprintf(stderr, "[label] mnemonic [operand] ; comment\n");
-        exit(1);
+    p1 = start;
+    p2 = start;
+    while (p1 < end) {
+        cr = memchr(p1, '\r', end - p1);   /* Move runs without \r */
+        if (cr == NULL)
+            cr = end;
+        if (p2 != p1)
+            memmove(p2, p1, cr - p1);
+        p2 += cr - p1;
+        p1 = cr + 1;
     }
-    
-    /*
-     ** Default settings
-     */
-    style = 0;
-    processor = P_6502;
-    start_mnemonic = 8;
-    start_operand = 16;
-    start_comment = 32;
-    tabs = 0;
-    align_comment = 1;
-    nesting_space = 4;
-    labels_own_line = 0;
-    mnemonics_case = 0;
-    directives_case = 0;
-    
-    /*
-     ** Process arguments
-     */
-    something = 0;
-    c = 1;
-    while (c < argc - 2) {
-        if (argv[c][0] != '-') {
-            fprintf(stderr, "Bad argument\n");
-            exit(1);
-        }
-        switch (tolower(argv[c][1])) {
-            case 's':	/* Style */
-                style = atoi(&argv[c][2]);
-                if (style != 0 && style != 1) {
-                    fprintf(stderr, "Bad style code: %d\n", style);
-                    exit(1);
-                }
-                break;
-            case 'p':	/* Processor */
-                request = atoi(&argv[c][2]);
-                if (request < 0 || request >= P_UNSUPPORTED) {
-                    fprintf(stderr, "Bad processor code: %d\n", request);
-                    exit(1);
-                }
-                processor = request;
-                break;
-            case 'm':	/* Mnemonic start */
-                if (tolower(argv[c][2]) == 'l') {
-                    mnemonics_case = 1;
-                } else if (tolower(argv[c][2]) == 'u') {
-                    mnemonics_case = 2;
-                } else {
-                    start_mnemonic = atoi(&argv[c][2]);
-                }
-                break;
-            case 'o':	/* Operand start */
-                start_operand = atoi(&argv[c][2]);
-                something = 1;
-                break;
-            case 'c':	/* Comment start */
-                start_comment = atoi(&argv[c][2]);
-                break;
-            case 't':	/* Tab size */
-                tabs = atoi(&argv[c][2]);
-                break;
-            case 'a':	/* Comment alignment */
-                align_comment = atoi(&argv[c][2]);
-                if (align_comment != 0 && align_comment != 1) {
-                    fprintf(stderr, "Bad comment alignment: %d\n", align_comment);
-                    exit(1);
-                }
-                break;
-            case 'n':	/* Nesting space */
-                nesting_space = atoi(&argv[c][2]);
-                break;
-            case 'l':	/* Labels in own line */
-                labels_own_line = 1;
-                break;
-            case 'd':	/* Directives */
-                if (tolower(argv[c][2]) == 'l') {
-                    directives_case = 1;
-                } else if (tolower(argv[c][2]) == 'u') {
-                    directives_case = 2;
-                } else {
-                    fprintf(stderr, "Unknown argument: %c%c\n", argv[c][1], argv[c][2]);
-                }
-                break;
-            default:	/* Other */
-                fprintf(stderr, "Unknown argument: %c\n", argv[c][1]);
-                exit(1);
-        }
-        c++;
+    if (trim) {     /* Remove trailing spaces */
+        while (p2 > start && IS_SPACE(*(p2 - 1)))
+            p2--;
     }
+    return p2 - start;
+}
+
+/*
+ ** Vector operations for the line index
+ */
+#if defined(__AVX2__)
+#define VECTOR_SIZE 32
+typedef __m256i vector;
+#define vector_set(c)       _mm256_set1_epi8(c)
+#define vector_load(p)      _mm256_loadu_si256((__m256i *) (p))
+#define vector_match(v, c)  ((unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, c)))
+#define vector_below(v, c)  ((unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(v, c), v)))
+#elif defined(__SSE2__)
+#define VECTOR_SIZE 16
+typedef __m128i vector;
+#define vector_set(c)       _mm_set1_epi8(c)
+#define vector_load(p)      _mm_loadu_si128((__m128i *) (p))
+#define vector_match(v, c)  ((unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(v, c)))
+#define vector_below(v, c)  ((unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(v, c), v)))
+#endif
+
+#define LINE_BLOCK  4096    /* Lines indexed at a time */
+
+/*
+ ** Index of lines, the end is the offset of \n (or the data size
+ ** for a last line without line break)
+ */
+struct line_index {
+    size_t count;
+    size_t end[LINE_BLOCK];
+    unsigned char cr[LINE_BLOCK];       /* Line contains \r */
+};
+
+/*
+ ** Index the lines starting at position, returns the position after
+ ** the last line indexed
+ */
+static size_t index_lines(char *data, size_t position, size_t size, struct line_index *index)
+{
+    size_t p;
+    int cr;
+#ifdef VECTOR_SIZE
+    vector newline;
+    vector carriage;
+    vector block;
+    unsigned int newlines;
+    unsigned int carriages;
+    unsigned int before;
+    int bit;
+#endif
     
-    /*
-     ** Validate constraints
-     */
-    if (style == 1) {
-        if (start_mnemonic > start_comment) {
-            fprintf(stderr, "Operand error: -m%d > -c%d\n", start_mnemonic, start_comment);
-            exit(1);
-        }
-        start_operand = start_mnemonic;
-    } else if (style == 0) {
-        if (start_mnemonic > start_operand) {
-            fprintf(stderr, "Operand error: -m%d > -o%d\n", start_mnemonic, start_operand);
-            exit(1);
-        }
-        if (start_operand > start_comment) {
-            fprintf(stderr, "Operand error: -o%d > -c%d\n", start_operand, start_comment);
-            exit(1);
+    index->count = 0;
+    p = position;
+    cr = 0;
+#ifdef VECTOR_SIZE
+    newline = vector_set('\n');
+    carriage = vector_set('\r');
+    while (p + VECTOR_SIZE <= size) {
+        block = vector_load(data + p);
+        newlines = vector_match(block, newline);
+        carriages = vector_match(block, carriage);
+        while (newlines != 0) {
+            bit = __builtin_ctz(newlines);
+            before = (1u << bit) - 1;
+            if (carriages & before)
+                cr = 1;
+            carriages &= ~before;
+            index->end[index->count] = p + bit;
+            index->cr[index->count++] = cr;
+            cr = 0;
+            if (index->count == LINE_BLOCK)
+                return p + bit + 1;
+            newlines &= newlines - 1;
         }
+        if (carriages != 0)
+            cr = 1;
+        p += VECTOR_SIZE;
     }
-    if (tabs > 0) {
-        if (start_mnemonic % tabs) {
-            fprintf(stderr, "Operand error: -m%d isn't a multiple of -t%d\n", start_mnemonic, tabs);
-            exit(1);
-        }
-        if (start_operand % tabs) {
-            fprintf(stderr, "Operand error: -m%d isn't a multiple of -t%d\n", start_operand, tabs);
-            exit(1);
-        }
-        if (start_comment % tabs) {
-            fprintf(stderr, "Operand error: -m%d isn't a multiple of -t%d\n", start_comment, tabs);
-            exit(1);
-        }
-        if (nesting_space % tabs) {
-            fprintf(stderr, "Operand error: -n%d isn't a multiple of -t%d\n", nesting_space, tabs);
-            exit(1);
+#endif
+    while (p < size) {
+        if (data[p] == '\n') {
+            index->end[index->count] = p;
+            index->cr[index->count++] = cr;
+            cr = 0;
+            if (index->count == LINE_BLOCK)
+                return p + 1;
+        } else if (data[p] == '\r') {
+            cr = 1;
         }
+        p++;
     }
-    if (something && processor == P_TMS9900) {
-        fprintf(stderr, "Warning: ignoring operand column, not possible because you selected TMS9900 mode\n");
+    if (index->count == 0 ? position < size : index->end[index->count - 1] + 1 < size) {
+        index->end[index->count] = size;  /* Last line without line break */
+        index->cr[index->count++] = cr;
     }
+    return size;
+}
+
+/*
+ ** Skip the bytes without any class in mask, 16/32 bytes at a time
+ **
+ ** The vector compares find the only bytes that can have a class,
+ ** and the table decides.
+ */
+static char *skip_to_class(unsigned char *classes, char *p, char *end, int mask)
+{
+#ifdef VECTOR_SIZE
+    vector space;
+    vector semicolon;
+    vector asterisk;
+    vector quote;
+    vector apostrophe;
+    vector block;
+    unsigned int candidates;
+    int bit;
     
-    /*
-     ** Open input file, measure it and read it into buffer
-     */
-    input = fopen(argv[c], "rb");
+    if (end - p >= VECTOR_SIZE) {
+        space = vector_set(' ');
+        semicolon = vector_set(';');
+        asterisk = vector_set('*');
+        quote = vector_set('"');
+        apostrophe = vector_set('\'');
+        do {
+            block = vector_load(p);
+            candidates = vector_below(block, space) | vector_match(block, semicolon)
+                       | vector_match(block, asterisk) | vector_match(block, quote)
+                       | vector_match(block, apostrophe);
+            while (candidates != 0) {
+                bit = __builtin_ctz(candidates);
+                if (classes[(unsigned char) p[bit]] & mask)
+                    return p + bit;
+                candidates &= candidates - 1;
+            }
+            p += VECTOR_SIZE;
+        } while (end - p >= VECTOR_SIZE);
+    }
+#endif
+    while (p < end && (classes[(unsigned char) *p] & mask) == 0)
+        p++;
+    return p;
+}
+
+/*
+ ** Skip a field until whitespace or comment
+ */
+KERNEL char *skip_field(int dialect, unsigned char *classes, char *start, char *p, char *end, int left_side)
+{
+    while (1) {
+        p = skip_to_class(classes, p, end, CLASS_SPACE | CLASS_COMMENT);
+        if (p >= end || (classes[(unsigned char) *p] & CLASS_SPACE))
+            break;
+        if (comment_present(dialect, start, p, end, left_side))
+            break;
+        p++;
+    }
+    return p;
+}
+
+/*
+ ** Skip whitespace until a field or comment
+ */
+KERNEL char *skip_spaces(int dialect, unsigned char *classes, char *start, char *p, char *end, int left_side)
+{
+    int c;
+    
+    while (p < end) {
+        c = classes[(unsigned char) *p];
+        if ((c & CLASS_SPACE) == 0)
+            break;
+        if ((c & CLASS_COMMENT) && comment_present(dialect, start, p, end, left_side))
+            break;
+        p++;
+    }
+    return p;
+}
+
+/*
+ ** State carried from line to line
+ */
+struct format_state {
+    struct pretty6502_options *options;
+    void (*format_line)(struct format_state *, char *, char *, struct output *);   /* Kernel for the processor */
+    struct pretty6502_dialect *index;   /* Keywords */
+    unsigned char *classes;             /* Character classes */
+    int current_level;                  /* Nesting level */
+    int prev_comment_original_location; /* Column of previous comment in input */
+    int prev_comment_final_location;    /* Column of previous comment in output */
+};
+
+/*
+ ** Write a keyword changing its case (0 = keep, 1 = lower, 2 = upper)
+ */
+static void write_case(struct output *output, char *p1, char *p2, int mode)
+{
+    if (mode == 0) {
+        output_bytes(output, p1, p2 - p1);
+        return;
+    }
+    while (p1 < p2) {
+        output_char(output, mode == 1 ? lower_case[(unsigned char) *p1] : upper_case[(unsigned char) *p1]);
+        p1++;
+    }
+}
+
+/*
+ ** Skip a string after its opening quote, the quote is searched
+ ** with memchr() and it is escaped if a backslash goes before it.
+ ** Unterminated strings stop at end of line.
+ */
+static inline char *skip_string(char *p, char *end, int quote)
+{
+    char *q;
+    
+    while ((q = memchr(p, quote, end - p)) != NULL) {
+        if (q[-1] != '\\')   /* Can be the opening quote */
+            return q + 1;
+        p = q + 1;
+    }
+    return end;
+}
+
+/*
+ ** Skip an apostrophe at p2 inside the operand starting at p1,
+ ** following the literal rules
+ */
+static inline char *skip_apostrophe(int literals, char *p1, char *p2, char *end)
+{
+    if ((literals & LITERAL_CHAR) && (p2 + 2 >= end || !IS_WORD(p2[1]) || !IS_WORD(p2[2]))) {
+        p2 += 2;    /* 'c or 'c' */
+        if (p2 < end && *p2 == '\'')
+            p2++;
+        else if (p2 > end)
+            p2 = end;
+        return p2;
+    }
+    if ((literals & LITERAL_AF_PRIME) && p2 - p1 >= 2 && LOWER(p2[-1]) == 'f' && LOWER(p2[-2]) == 'a'
+    && (p2 - p1 == 2 || !IS_WORD(p2[-3])))
+        return p2 + 1;
+    if ((literals & LITERAL_AF_PAIR) && p2 - p1 >= 5 && memcmp(p2 - 5, "AF,AF", 5) == 0)
+        return p2 + 1;
+    return skip_string(p2 + 1, end, '\'');
+}
+
+/*
+ ** Skip the operand starting at p1 up to the comment, jumping over
+ ** strings and character literals (following the literal rules),
+ ** returns its end without spaces
+ */
+KERNEL char *skip_operand(int dialect, unsigned char *classes, int literals, char *p, char *p1, char *end)
+{
+    char *p2;
+    
+    p2 = p1;
+    while (1) {
+        p2 = skip_to_class(classes, p2, end, CLASS_COMMENT | CLASS_QUOTE);
+        if (p2 >= end)
+            break;
+        if ((classes[(unsigned char) *p2] & CLASS_COMMENT) && comment_present(dialect, p, p2, end, 0))
+            break;
+        if (*p2 == '"')
+            p2 = skip_string(p2 + 1, end, '"');
+        else if (*p2 != '\'')
+            p2++;
+        else
+            p2 = skip_apostrophe(literals, p1, p2, end);
+    }
+    while (p2 > p1 && IS_SPACE(*(p2 - 1)))
+        p2--;
+    return p2;
+}
+
+/*
+ ** Format a line into the output file (kernel)
+ **
+ ** The line goes from p to end (not included), it is never modified.
+ */
+KERNEL void format_kernel(struct format_state *state, char *p, char *end, struct output *output, int dialect)
+{
+    char *p1;
+    char *p2;
+    int c;
+    int current_column;
+    int request;
+    int flags;
+    int indent;
+    int something;
+    struct pretty6502_options *options;
+    unsigned char *classes;
+    
+    options = state->options;
+    classes = state->classes;
+    something = 0;
+    current_column = 0;
+    p1 = p;
+    p2 = p1;
+    
+    p2 = skip_field(dialect, classes, p, p2, end, 1);
+    if (p2 - p1) {	/* Label */
+        something = 1;
+        output_bytes(output, p1, p2 - p1);
+        current_column = p2 - p1;
+        p1 = p2;
+    } else {
+        current_column = 0;
+    }
+    p1 = skip_spaces(dialect, classes, p, p1, end, 1);
+    indent = state->current_level * options->nesting_space;
+    flags = 0;
+    if (p1 < end && !comment_present(dialect, p, p1, end, 1)) {	/* Mnemonic */
+        p2 = p1;
+        p2 = skip_field(dialect, classes, p, p2, end, 0);
+        if (dialect != DIALECT_UNKNOWN) {   /* The processor is defined */
+            c = find_opcode(state->index, dialect, p1, p2, &flags);
+            if (c == 0) {   /* No match */
+                request = options->start_mnemonic;
+            } else if (c < 0) { /* Mnemonic */
+                request = options->start_mnemonic;
+            } else {    /* Directive */
+                if (flags & DONT_RELOCATE_LABEL)
+                    request = options->start_operand;
+                else
+                    request = options->start_mnemonic;
+            }
+        } else {
+            request = options->start_mnemonic;
+            c = 0;
+        }
+        STAT(lines[c > 0 ? LINE_DIRECTIVE : c < 0 ? LINE_MNEMONIC : LINE_UNKNOWN]);
+        /*
+         ** Move label to own line
+         */ 
+        if (current_column != 0 && options->labels_own_line != 0 && (flags & DONT_RELOCATE_LABEL) == 0) {
+            output_char(output, '\n');
+            current_column = 0;
+        }
+        if (flags & LEVEL_OUT) {    /* Directive, exits nested level */
+            if (state->current_level > 0) {
+                state->current_level--;
+                indent -= options->nesting_space;
+            }
+        }
+        if (flags & LEVEL_MINUS) {  /* Directive, enters nested level */
+            if (indent >= options->nesting_space)
+                indent -= options->nesting_space;
+            else
+                indent = 0;
+        }
+        request += indent;
+        request_space(output, options->tabs, &current_column, request, 1);
+        something = 1;
+        if (c <= 0)     /* Mnemonic or unknown */
+            write_case(output, p1, p2, options->mnemonics_case);
+        else            /* Directive */
+            write_case(output, p1, p2, options->directives_case);
+        current_column += p2 - p1;
+        p1 = p2;
+        p1 = skip_spaces(dialect, classes, p, p1, end, 0);
+        if (p1 < end && !comment_present(dialect, p, p1, end, 0)) {	/* Operand */
+            if (dialect == DIALECT_TMS9900)
+                request = current_column + 1;
+            else
+                request = options->start_operand + indent;
+            request_space(output, options->tabs, &current_column, request, 1);
+            p2 = skip_operand(dialect, classes, state->index->literals, p, p1, end);
+            something = 1;
+            output_bytes(output, p1, p2 - p1);
+            current_column += p2 - p1;
+            p1 = p2;
+            p1 = skip_spaces(dialect, classes, p, p1, end, 0);
+        }
+        if (flags & LEVEL_IN) {
+            state->current_level++;
+        }
+    } else {
+        STAT(lines[something ? LINE_LABEL : p1 < end ? LINE_COMMENT : LINE_EMPTY]);
+    }
+    if (comment_present(dialect, p, p1, end, !something)) {	/* Comment */
+        if (dialect == DIALECT_TMS9900) {
+            while (p1 < end && IS_SPACE(*p1))
+                p1++;
+        }
+        
+        /*
+         ** Try to keep comments aligned vertically (only works
+         ** if spaces were used in source file)
+         */
+        p2 = p1;
+        while (p2 - 1 >= p && IS_SPACE(*(p2 - 1)))
+            p2--;
+        if (dialect == DIALECT_TMS9900 && p2 == p && *p1 == '*') {
+            request = 0;    /* Cannot be other */
+        } else if (p2 == p && p1 - p == state->prev_comment_original_location) {
+            request = state->prev_comment_final_location;
+        } else {
+            state->prev_comment_original_location = p1 - p;
+            if (current_column == 0)
+                request = 0;
+            else if (current_column < options->start_mnemonic + indent)
+                request = options->start_mnemonic + indent;
+            else
+                request = options->start_comment + indent;
+            if (current_column == 0 && options->align_comment == 1)
+                request = options->start_mnemonic + indent;
+            state->prev_comment_final_location = request;
+        }
+        request_space(output, options->tabs, &current_column, request, (*p1 == ';') ? 0 : 2);
+        p2 = end;
+        while (p2 > p1 && IS_SPACE(*(p2 - 1)))
+            p2--;
+        output_bytes(output, p1, p2 - p1);
+        current_column += p2 - p1;
+    } else if (something == 0) {
+        state->prev_comment_original_location = 0;
+        state->prev_comment_final_location = 0;
+    }
+    output_char(output, '\n');
+}
+
+/*
+ ** The kernel for each dialect
+ */
+static void format_line_unknown(struct format_state *state, char *p, char *end, struct output *output)
+{
+    format_kernel(state, p, end, output, DIALECT_UNKNOWN);
+}
+
+static void format_line_plain(struct format_state *state, char *p, char *end, struct output *output)
+{
+    format_kernel(state, p, end, output, DIALECT_PLAIN);
+}
+
+static void format_line_dotted(struct format_state *state, char *p, char *end, struct output *output)
+{
+    format_kernel(state, p, end, output, DIALECT_DOTTED);
+}
+
+static void format_line_tms9900(struct format_state *state, char *p, char *end, struct output *output)
+{
+    format_kernel(state, p, end, output, DIALECT_TMS9900);
+}
+
+/*
+ ** Find the directive in a line the same way as format_kernel()
+ ** does but without formatting, returns the end of the mnemonic
+ ** field (or NULL if there isn't one) and its flags
+ */
+static char *line_directive(struct format_state *state, char *p, char *end, int *flags)
+{
+    char *p1;
+    char *p2;
+    int dialect;
+    
+    *flags = 0;
+    dialect = state->index->dialect;
+    if (dialect == DIALECT_UNKNOWN)
+        return NULL;
+    p1 = skip_field(dialect, state->classes, p, p, end, 1);
+    p1 = skip_spaces(dialect, state->classes, p, p1, end, 1);
+    if (p1 >= end || comment_present(dialect, p, p1, end, 1))
+        return NULL;
+    p2 = skip_field(dialect, state->classes, p, p1, end, 0);
+    find_opcode(state->index, dialect, p1, p2, flags);
+    return p2;
+}
+
+/*
+ ** Flags of the directive in a line
+ */
+static int line_flags(struct format_state *state, char *p, char *end)
+{
+    int flags;
+    
+    line_directive(state, p, end, &flags);
+    return flags;
+}
+
+/*
+ ** Name of the file included by a line, returns its length (zero
+ ** if the line doesn't include a file). The name can be between
+ ** quotes or angle brackets, or else it ends at the first space.
+ */
+static size_t line_include(struct format_state *state, char *p, char *end, char **name)
+{
+    char *p1;
+    char *p2;
+    int dialect;
+    int flags;
+    
+    dialect = state->index->dialect;
+    p1 = line_directive(state, p, end, &flags);
+    if (p1 == NULL || (flags & INCLUDE_FILE) == 0) {
+        if (dialect == DIALECT_UNKNOWN)
+            return 0;
+        p1 = skip_field(dialect, state->classes, p, p, end, 1);   /* Directive at line start */
+        if (p1 == p || find_opcode(state->index, dialect, p, p1, &flags) <= 0 || (flags & INCLUDE_FILE) == 0)
+            return 0;
+    }
+    p1 = skip_spaces(dialect, state->classes, p, p1, end, 0);
+    if (p1 >= end || comment_present(dialect, p, p1, end, 0))
+        return 0;
+    if (*p1 == '"' || *p1 == '\'' || *p1 == '<') {
+        p2 = memchr(p1 + 1, *p1 == '<' ? '>' : *p1, end - p1 - 1);
+        if (p2 == NULL)
+            return 0;
+        p1++;
+    } else {
+        p2 = skip_field(dialect, state->classes, p, p1, end, 0);
+    }
+    *name = p1;
+    return p2 - p1;
+}
+
+/*
+ ** Fields found by split_line()
+ */
+#define SPLIT_MNEMONIC  0x01
+#define SPLIT_OPERAND   0x02
+#define SPLIT_COMMENT   0x04    /* Can be empty (TMS9900) */
+
+/*
+ ** Split a line in fields the same way as format_kernel() does,
+ ** returns the fields found
+ */
+static int split_line(struct format_state *state, char *p, char *end, struct pretty6502_token *token)
+{
+    unsigned char *classes;
+    char *p1;
+    char *p2;
+    int dialect;
+    int something;
+    int flags;
+    int fields;
+    
+    fields = 0;
+    dialect = state->index->dialect;
+    classes = state->classes;
+    p2 = skip_field(dialect, classes, p, p, end, 1);
+    token->label_length = p2 - p;
+    something = p2 > p;
+    p1 = skip_spaces(dialect, classes, p, p2, end, 1);
+    if (p1 < end && !comment_present(dialect, p, p1, end, 1)) {
+        p2 = skip_field(dialect, classes, p, p1, end, 0);
+        token->mnemonic = p1 - p;
+        token->mnemonic_length = p2 - p1;
+        flags = 0;
+        if (dialect != DIALECT_UNKNOWN)
+            token->keyword = find_opcode(state->index, dialect, p1, p2, &flags);
+        token->flags |= flags;
+        fields |= SPLIT_MNEMONIC;
+        p1 = skip_spaces(dialect, classes, p, p2, end, 0);
+        if (p1 < end && !comment_present(dialect, p, p1, end, 0)) {
+            p2 = skip_operand(dialect, classes, state->index->literals, p, p1, end);
+            token->operand = p1 - p;
+            token->operand_length = p2 - p1;
+            fields |= SPLIT_OPERAND;
+            p1 = skip_spaces(dialect, classes, p, p2, end, 0);
+        }
+        something = 1;
+    }
+    if (comment_present(dialect, p, p1, end, !something)) {
+        fields |= SPLIT_COMMENT;
+        if (dialect == DIALECT_TMS9900) {
+            while (p1 < end && IS_SPACE(*p1))
+                p1++;
+        }
+        p2 = end;
+        while (p2 > p1 && IS_SPACE(*(p2 - 1)))
+            p2--;
+        token->comment = p1 - p;
+        token->comment_length = p2 - p1;
+    }
+    return fields;
+}
+
+/*
+ ** Split a line in fields, updating the nesting level, returns the
+ ** fields found
+ */
+static int token_line(struct format_state *state, char *p, char *end, struct pretty6502_token *token)
+{
+    int level;
+    int fields;
+    
+    fields = split_line(state, p, end, token);
+    level = state->current_level;
+    if ((token->flags & LEVEL_OUT) && state->current_level > 0) {
+        state->current_level--;
+        level--;
+    }
+    if ((token->flags & LEVEL_MINUS) && level > 0)
+        level--;
+    if (token->flags & LEVEL_IN)
+        state->current_level++;
+    token->level = level;
+    return fields;
+}
+
+/*
+ ** Start the state for formatting, choosing the kernel
+ **
+ ** Returns zero if successful.
+ */
+static int start_state(struct format_state *state, struct pretty6502_options *options)
+{
+    memset(state, 0, sizeof(*state));
+    state->options = options;
+    if (options->dialect != NULL)
+        state->index = options->dialect;
+    else
+        state->index = processor_index[options->processor];
+    if (state->index == NULL)
+        return 1;
+    if (state->index->dialect == DIALECT_TMS9900)
+        state->classes = char_classes[P_TMS9900];
+    else
+        state->classes = char_classes[P_UNK];
+    switch (state->index->dialect) {
+        case DIALECT_UNKNOWN:
+            state->format_line = format_line_unknown;
+            break;
+        case DIALECT_DOTTED:
+            state->format_line = format_line_dotted;
+            break;
+        case DIALECT_TMS9900:
+            state->format_line = format_line_tms9900;
+            break;
+        default:
+            state->format_line = format_line_plain;
+            break;
+    }
+    return 0;
+}
+
+/*
+ ** Lines of the input
+ **
+ ** Each line is a span of the input, without \r characters and
+ ** trailing spaces. The rare lines with \r in the middle are the
+ ** only ones copied.
+ */
+struct line_reader {
+    char *data;         /* Start of input */
+    char *p;            /* Next line */
+    char *limit;        /* End of lines to read */
+    size_t current;     /* Next line in index */
+    char *scratch;
+    size_t scratch_size;
+    struct line_index index;
+};
+
+/*
+ ** Start reading the lines from start to stop (at line boundaries),
+ ** returns NULL if there isn't enough memory
+ */
+static struct line_reader *open_lines(char *data, size_t start, size_t stop)
+{
+    struct line_reader *reader;
+    
+    reader = malloc(sizeof(struct line_reader));
+    if (reader == NULL)
+        return NULL;
+    reader->data = data;
+    reader->p = data + start;
+    reader->limit = data + stop;
+    reader->current = 0;
+    reader->index.count = 0;
+    reader->scratch = NULL;
+    reader->scratch_size = 0;
+    return reader;
+}
+
+/*
+ ** Read the next line, returns 1 if there is one, 0 at end,
+ ** or -1 if there isn't enough memory
+ */
+static int next_line(struct line_reader *reader, char **line, char **line_end)
+{
+    char *p;
+    char *end;
+    char *next;
+    char *new_scratch;
+    size_t length;
+    
+    if (reader->current >= reader->index.count) {
+        if (reader->p >= reader->limit)
+            return 0;
+        STAT_ADD(normalize, -clock_nanoseconds());  /* Adds the difference */
+        index_lines(reader->data, reader->p - reader->data, reader->limit - reader->data, &reader->index);
+        STAT_ADD(normalize, clock_nanoseconds());
+        reader->current = 0;
+    }
+    p = reader->p;
+    end = reader->data + reader->index.end[reader->current];
+    if (end < reader->limit) {
+        next = end + 1;
+        while (end > p && IS_SPACE(*(end - 1)))   /* Remove trailing spaces */
+            end--;
+    } else {
+        next = reader->limit;   /* Last line without line break */
+    }
+    reader->p = next;
+    if (reader->index.cr[reader->current++] && memchr(p, '\r', end - p) != NULL) {   /* Ignore \r characters */
+        if ((size_t) (end - p) > reader->scratch_size) {
+            new_scratch = realloc(reader->scratch, end - p);
+            if (new_scratch == NULL)
+                return -1;
+            reader->scratch = new_scratch;
+            reader->scratch_size = end - p;
+        }
+        memcpy(reader->scratch, p, end - p);
+        STAT_ADD(normalize, -clock_nanoseconds());
+        length = prepare_line(reader->scratch, reader->scratch + (end - p), 0);
+        STAT_ADD(normalize, clock_nanoseconds());
+        if (next == reader->limit && end == reader->limit && length == 0 && p != reader->data)
+            return 0;   /* Only \r after last line */
+        *line = reader->scratch;
+        *line_end = reader->scratch + length;
+        return 1;
+    }
+    *line = p;
+    *line_end = end;
+    return 1;
+}
+
+/*
+ ** Stop reading lines
+ */
+static void close_lines(struct line_reader *reader)
+{
+    free(reader->scratch);
+    free(reader);
+}
+
+/*
+ ** Label cross-reference
+ **
+ ** Names are interned in an arena through an open addressing hash
+ ** table. Each symbol keeps its references as a list inside a shared
+ ** array (index zero ends the list). Every name found in operands is
+ ** a symbol, only the ones defined as labels are written.
+ */
+#define XREF_ARENA      65536   /* Size of each arena block */
+#define IS_NAME(c)      (IS_WORD(c) || (c) == '.' || (c) == '@')
+
+struct xref_block {
+    struct xref_block *next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+struct xref_symbol {
+    char *name;
+    unsigned int length;
+    unsigned int line;      /* Definition (zero if only used) */
+    unsigned int flags;
+    unsigned int first;     /* References list */
+    unsigned int last;
+    unsigned int count;
+};
+
+struct xref_reference {
+    unsigned int line;
+    unsigned int next;
+};
+
+struct xref {
+    struct xref_block *arena;
+    struct xref_symbol *symbols;
+    unsigned int symbol_count;
+    unsigned int symbol_size;
+    unsigned int *table;    /* Symbol plus one, zero is empty */
+    unsigned int table_size;
+    struct xref_reference *references;
+    unsigned int reference_count;
+    unsigned int reference_size;
+    int error;
+};
+
+/*
+ ** Copy a name into the arena
+ */
+static char *xref_copy(struct xref *xref, char *name, size_t length)
+{
+    struct xref_block *block;
+    size_t size;
+    char *p;
+    
+    block = xref->arena;
+    if (block == NULL || block->used + length + 1 > block->size) {
+        size = length + 1 > XREF_ARENA ? length + 1 : XREF_ARENA;
+        block = malloc(sizeof(struct xref_block) + size);
+        if (block == NULL)
+            return NULL;
+        block->next = xref->arena;
+        block->used = 0;
+        block->size = size;
+        xref->arena = block;
+    }
+    p = block->data + block->used;
+    memcpy(p, name, length);
+    p[length] = '\0';
+    block->used += length + 1;
+    return p;
+}
+
+/*
+ ** Find a name in the table, returns its slot
+ */
+static unsigned int xref_slot(struct xref *xref, char *name, size_t length)
+{
+    struct xref_symbol *symbol;
+    unsigned int hash;
+    unsigned int slot;
+    size_t c;
+    
+    hash = 2166136261U;
+    for (c = 0; c < length; c++)
+        hash = (hash ^ (unsigned char) name[c]) * 16777619U;
+    slot = hash & (xref->table_size - 1);
+    while (xref->table[slot] != 0) {
+        symbol = &xref->symbols[xref->table[slot] - 1];
+        if (symbol->length == length && memcmp(symbol->name, name, length) == 0)
+            break;
+        slot = (slot + 1) & (xref->table_size - 1);
+    }
+    return slot;
+}
+
+/*
+ ** Intern a name, returns its symbol or NULL if out of memory
+ */
+static struct xref_symbol *xref_symbol(struct xref *xref, char *name, size_t length)
+{
+    struct xref_symbol *symbol;
+    unsigned int *table;
+    unsigned int size;
+    unsigned int slot;
+    unsigned int c;
+    
+    slot = xref_slot(xref, name, length);
+    if (xref->table[slot] != 0)
+        return &xref->symbols[xref->table[slot] - 1];
+    if (xref->symbol_count == xref->symbol_size) {
+        symbol = realloc(xref->symbols, xref->symbol_size * 2 * sizeof(struct xref_symbol));
+        if (symbol == NULL)
+            return NULL;
+        xref->symbols = symbol;
+        xref->symbol_size *= 2;
+    }
+    if ((xref->symbol_count + 1) * 2 > xref->table_size) {   /* Keep it half empty */
+        size = xref->table_size * 2;
+        table = calloc(size, sizeof(unsigned int));
+        if (table == NULL)
+            return NULL;
+        free(xref->table);
+        xref->table = table;
+        xref->table_size = size;
+        for (c = 0; c < xref->symbol_count; c++) {
+            symbol = &xref->symbols[c];
+            xref->table[xref_slot(xref, symbol->name, symbol->length)] = c + 1;
+        }
+        slot = xref_slot(xref, name, length);
+    }
+    symbol = &xref->symbols[xref->symbol_count];
+    symbol->name = xref_copy(xref, name, length);
+    if (symbol->name == NULL)
+        return NULL;
+    symbol->length = length;
+    symbol->line = 0;
+    symbol->flags = 0;
+    symbol->first = 0;
+    symbol->last = 0;
+    symbol->count = 0;
+    xref->table[slot] = ++xref->symbol_count;
+    return symbol;
+}
+
+/*
+ ** Add a reference to a symbol (once per line)
+ */
+static void xref_use(struct xref *xref, char *name, size_t length, unsigned int line)
+{
+    struct xref_symbol *symbol;
+    struct xref_reference *reference;
+    
+    symbol = xref_symbol(xref, name, length);
+    if (symbol == NULL) {
+        xref->error = 1;
+        return;
+    }
+    if (symbol->last != 0 && xref->references[symbol->last].line == line)
+        return;
+    if (xref->reference_count == xref->reference_size) {
+        reference = realloc(xref->references, xref->reference_size * 2 * sizeof(struct xref_reference));
+        if (reference == NULL) {
+            xref->error = 1;
+            return;
+        }
+        xref->references = reference;
+        xref->reference_size *= 2;
+    }
+    reference = &xref->references[xref->reference_count];
+    reference->line = line;
+    reference->next = 0;
+    if (symbol->last != 0)
+        xref->references[symbol->last].next = xref->reference_count;
+    else
+        symbol->first = xref->reference_count;
+    symbol->last = xref->reference_count++;
+    symbol->count++;
+}
+
+/*
+ ** Add the definition of a label
+ */
+static void xref_define(struct xref *xref, char *name, size_t length, unsigned int line, int equate)
+{
+    struct xref_symbol *symbol;
+    
+    symbol = xref_symbol(xref, name, length);
+    if (symbol == NULL) {
+        xref->error = 1;
+    } else if (symbol->line != 0) {
+        symbol->flags |= PRETTY6502_XREF_REDEFINED;
+    } else {
+        symbol->line = line;
+        if (equate)
+            symbol->flags |= PRETTY6502_XREF_EQUATE;
+    }
+}
+
+/*
+ ** Start a cross-reference, returns zero if successful
+ */
+static int open_xref(struct xref *xref)
+{
+    xref->arena = NULL;
+    xref->symbol_count = 0;
+    xref->symbol_size = 256;
+    xref->table_size = 512;
+    xref->reference_count = 1;  /* Zero ends lists */
+    xref->reference_size = 1024;
+    xref->error = 0;
+    xref->symbols = malloc(xref->symbol_size * sizeof(struct xref_symbol));
+    xref->table = calloc(xref->table_size, sizeof(unsigned int));
+    xref->references = malloc(xref->reference_size * sizeof(struct xref_reference));
+    return xref->symbols == NULL || xref->table == NULL || xref->references == NULL;
+}
+
+/*
+ ** Release a cross-reference
+ */
+static void close_xref(struct xref *xref)
+{
+    struct xref_block *block;
+    
+    while ((block = xref->arena) != NULL) {
+        xref->arena = block->next;
+        free(block);
+    }
+    free(xref->symbols);
+    free(xref->table);
+    free(xref->references);
+}
+
+/*
+ ** Add the label and the names used in the operand of a line
+ **
+ ** A label that is a keyword (a directive at column zero) isn't
+ ** a definition. Numbers and names after $ (hexadecimal) are
+ ** ignored, strings and character literals are jumped over.
+ */
+static void xref_line(struct xref *xref, struct format_state *state, char *p, char *end, unsigned int line)
+{
+    struct pretty6502_token token;
+    char *p1;
+    char *p2;
+    char *start;
+    size_t length;
+    int flags;
+    
+    memset(&token, 0, sizeof(token));
+    split_line(state, p, end, &token);
+    length = token.label_length;
+    while (length > 0 && p[length - 1] == ':')
+        length--;
+    if (length != 0 && (state->index->dialect == DIALECT_UNKNOWN || find_opcode(state->index, state->index->dialect, p, p + length, &flags) == 0))
+        xref_define(xref, p, length, line, token.keyword > 0 && (token.flags & DONT_RELOCATE_LABEL));
+    start = p + token.operand;
+    p1 = start;
+    p2 = start + token.operand_length;
+    while (p1 < p2) {
+        if (*p1 == '"') {
+            p1 = skip_string(p1 + 1, p2, '"');
+        } else if (*p1 == '\'') {
+            p1 = skip_apostrophe(state->index->literals, start, p1, p2);
+        } else if (IS_NAME(*p1)) {
+            p = p1;
+            while (p1 < p2 && IS_NAME(*p1))
+                p1++;
+            if ((*p < '0' || *p > '9') && (p == start || p[-1] != '$'))
+                xref_use(xref, p, p1 - p, line);
+        } else {
+            p1++;
+        }
+    }
+}
+
+/*
+ ** Compare two symbols by name
+ */
+static int compare_symbols(const void *a, const void *b)
+{
+    struct xref_symbol *symbol1 = *(struct xref_symbol **) a;
+    struct xref_symbol *symbol2 = *(struct xref_symbol **) b;
+    int c;
+    
+    c = memcmp(symbol1->name, symbol2->name, symbol1->length < symbol2->length ? symbol1->length : symbol2->length);
+    if (c != 0)
+        return c;
+    return symbol1->length < symbol2->length ? -1 : symbol1->length > symbol2->length;
+}
+
+/*
+ ** Write the defined symbols sorted by name, their references and
+ ** their names
+ */
+static void write_xref(struct xref *xref, struct output *output)
+{
+    struct pretty6502_xref_header header;
+    struct pretty6502_xref_symbol record;
+    struct xref_symbol **sorted;
+    struct xref_symbol *symbol;
+    unsigned int count;
+    unsigned int c;
+    unsigned int d;
+    
+    sorted = malloc((xref->symbol_count + 1) * sizeof(struct xref_symbol *));
+    if (sorted == NULL) {
+        output->error = 1;
+        return;
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PRETTY6502_XREF_MAGIC, sizeof(header.magic));
+    header.version = PRETTY6502_XREF_VERSION;
+    header.header_size = sizeof(header);
+    header.symbol_size = sizeof(record);
+    count = 0;
+    for (c = 0; c < xref->symbol_count; c++) {
+        symbol = &xref->symbols[c];
+        if (symbol->line != 0) {
+            sorted[count++] = symbol;
+            header.references += symbol->count;
+            header.names_size += symbol->length + 1;
+        }
+    }
+    header.symbols = count;
+    qsort(sorted, count, sizeof(struct xref_symbol *), compare_symbols);
+    output_bytes(output, (char *) &header, sizeof(header));
+    record.name = 0;
+    record.reference = 0;
+    for (c = 0; c < count; c++) {
+        symbol = sorted[c];
+        record.length = symbol->length;
+        record.line = symbol->line;
+        record.flags = symbol->flags;
+        record.count = symbol->count;
+        output_bytes(output, (char *) &record, sizeof(record));
+        record.name += symbol->length + 1;
+        record.reference += symbol->count;
+    }
+    for (c = 0; c < count; c++) {
+        for (d = sorted[c]->first; d != 0; d = xref->references[d].next)
+            output_bytes(output, (char *) &xref->references[d].line, sizeof(unsigned int));
+    }
+    for (c = 0; c < count; c++)
+        output_bytes(output, sorted[c]->name, sorted[c]->length + 1);
+    free(sorted);
+}
+
+/*
+ ** Format the input into the output file
+ **
+ ** Only the lines from first to last (counting from 1) are written,
+ ** the previous ones are processed without output to get the nesting
+ ** level and the comment alignment.
+ **
+ ** Without sink only the cross-reference is built.
+ */
+static void format_data(struct pretty6502_options *options, char *data, size_t size, size_t first, size_t last, struct output *output, struct xref *xref)
+{
+    struct format_state state;
+    struct line_reader *reader;
+    char *p;
+    char *end;
+    size_t line;
+    int c;
+    
+    if (start_state(&state, options)) {
+        output->error = 1;
+        return;
+    }
+    reader = open_lines(data, 0, size);
+    if (reader == NULL) {
+        output->error = 1;
+        return;
+    }
+    line = 1;
+    while (line <= last && !output->error) {
+        c = next_line(reader, &p, &end);
+        if (c <= 0) {
+            if (c < 0)
+                output->error = 1;
+            break;
+        }
+        output->discard = line < first;
+        STAT_PRESCAN(output->discard);
+        if (output->sink != NULL)
+            state.format_line(&state, p, end, output);
+        STAT_PRESCAN(1);
+        if (xref != NULL)
+            xref_line(xref, &state, p, end, line);
+        line++;
+    }
+    STAT_PRESCAN(0);
+    output->discard = 0;
+    if (size == 0 && first <= 1 && output->sink != NULL)    /* Empty file still has a line */
+        state.format_line(&state, data, data, output);
+    close_lines(reader);
+}
+
+/*
+ ** Fill options with default settings
+ */
+void pretty6502_defaults(struct pretty6502_options *options)
+{
+    options->style = 0;
+    options->processor = P_6502;
+    options->start_mnemonic = 8;
+    options->start_operand = 16;
+    options->start_comment = 32;
+    options->tabs = 0;
+    options->align_comment = 1;
+    options->nesting_space = 4;
+    options->labels_own_line = 0;
+    options->mnemonics_case = 0;
+    options->directives_case = 0;
+    options->dialect = NULL;
+}
+
+/*
+ ** Validate constraints of options
+ */
+int pretty6502_check(struct pretty6502_options *options, char *message)
+{
+    if (options->style != 0 && options->style != 1) {
+        sprintf(message, "Bad style code: %d", options->style);
+        return 1;
+    }
+    if (options->processor < 0 || options->processor >= P_UNSUPPORTED) {
+        sprintf(message, "Bad processor code: %d", options->processor);
+        return 1;
+    }
+    if (options->align_comment != 0 && options->align_comment != 1) {
+        sprintf(message, "Bad comment alignment: %d", options->align_comment);
+        return 1;
+    }
+    if (options->style == 1) {
+        if (options->start_mnemonic > options->start_comment) {
+            sprintf(message, "Operand error: -m%d > -c%d", options->start_mnemonic, options->start_comment);
+            return 1;
+        }
+        options->start_operand = options->start_mnemonic;
+    } else if (options->style == 0) {
+        if (options->start_mnemonic > options->start_operand) {
+            sprintf(message, "Operand error: -m%d > -o%d", options->start_mnemonic, options->start_operand);
+            return 1;
+        }
+        if (options->start_operand > options->start_comment) {
+            sprintf(message, "Operand error: -o%d > -c%d", options->start_operand, options->start_comment);
+            return 1;
+        }
+    }
+    if (options->tabs > 0) {
+        if (options->start_mnemonic % options->tabs) {
+            sprintf(message, "Operand error: -m%d isn't a multiple of -t%d", options->start_mnemonic, options->tabs);
+            return 1;
+        }
+        if (options->start_operand % options->tabs) {
+            sprintf(message, "Operand error: -m%d isn't a multiple of -t%d", options->start_operand, options->tabs);
+            return 1;
+        }
+        if (options->start_comment % options->tabs) {
+            sprintf(message, "Operand error: -m%d isn't a multiple of -t%d", options->start_comment, options->tabs);
+            return 1;
+        }
+        if (options->nesting_space % options->tabs) {
+            sprintf(message, "Operand error: -n%d isn't a multiple of -t%d", options->nesting_space, options->tabs);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ ** Format a buffer
+ */
+int pretty6502_format(struct pretty6502_options *options, char *data, size_t size, pretty6502_sink sink, void *context)
+{
+    return pretty6502_format_lines(options, data, size, 1, (size_t) -1, sink, context);
+}
+
+/*
+ ** Format a range of lines of a buffer
+ */
+int pretty6502_format_lines(struct pretty6502_options *options, char *data, size_t size, size_t first, size_t last, pretty6502_sink sink, void *context)
+{
+    struct output output;
+    
+    pthread_once(&keyword_index_once, build_indexes);
+    output.sink = sink;
+    output.context = context;
+    output.used = 0;
+    output.error = 0;
+    output.discard = 0;
+    output.buffer = malloc(OUTPUT_BUFFER);
+    if (output.buffer == NULL)
+        return 1;
+    format_data(options, data, size, first, last, &output, NULL);
+    output_flush(&output);
+    free(output.buffer);
+    return output.error;
+}
+
+/*
+ ** Format a buffer building its label cross-reference
+ */
+int pretty6502_format_xref(struct pretty6502_options *options, char *data, size_t size, pretty6502_sink sink, void *context, pretty6502_sink xref_sink, void *xref_context)
+{
+    struct output output;
+    struct xref xref;
+    int error;
+    
+    pthread_once(&keyword_index_once, build_indexes);
+    output.sink = sink;
+    output.context = context;
+    output.used = 0;
+    output.error = 0;
+    output.discard = 0;
+    output.buffer = malloc(OUTPUT_BUFFER);
+    if (output.buffer == NULL)
+        return 1;
+    if (open_xref(&xref)) {
+        close_xref(&xref);
+        free(output.buffer);
+        return 1;
+    }
+    format_data(options, data, size, 1, (size_t) -1, &output, &xref);
+    output_flush(&output);
+    if (!output.error && !xref.error) {
+        output.sink = xref_sink;
+        output.context = xref_context;
+        write_xref(&xref, &output);
+        output_flush(&output);
+    }
+    error = output.error || xref.error;
+    close_xref(&xref);
+    free(output.buffer);
+    return error;
+}
+
+/*
+ ** Memory buffer for pretty6502_format_buffer()
+ */
+struct memory_sink {
+    char *data;
+    size_t used;
+    size_t size;
+};
+
+/*
+ ** Sink for a memory buffer
+ */
+static int write_memory(void *context, char *data, size_t length)
+{
+    struct memory_sink *memory = context;
+    char *new_data;
+    
+    if (memory->used + length > memory->size) {
+        memory->size = (memory->used + length) * 2;
+        new_data = realloc(memory->data, memory->size);
+        if (new_data == NULL)
+            return 1;
+        memory->data = new_data;
+    }
+    memcpy(memory->data + memory->used, data, length);
+    memory->used += length;
+    return 0;
+}
+
+/*
+ ** Format a buffer into a new buffer
+ */
+char *pretty6502_format_buffer(struct pretty6502_options *options, char *data, size_t size, size_t *length)
+{
+    struct memory_sink memory;
+    
+    memory.size = size + size / 4 + 256;    /* Usually enough */
+    memory.used = 0;
+    memory.data = malloc(memory.size);
+    if (memory.data == NULL)
+        return NULL;
+    if (pretty6502_format(options, data, size, write_memory, &memory)) {
+        free(memory.data);
+        return NULL;
+    }
+    *length = memory.used;
+    return memory.data;
+}
+
+/*
+ ** Format a buffer line by line, giving each input line (with its
+ ** line break) and its formatted text to the callback
+ */
+int pretty6502_format_each(struct pretty6502_options *options, char *data, size_t size, pretty6502_line found, void *context)
+{
+    struct format_state state;
+    struct line_reader *reader;
+    struct output output;
+    struct memory_sink line;
+    char *p;
+    char *end;
+    char *input;
+    int c;
+    
+    pthread_once(&keyword_index_once, build_indexes);
+    if (start_state(&state, options))
+        return 1;
+    line.data = NULL;
+    line.used = 0;
+    line.size = 0;
+    output.sink = write_memory;     /* Only used if a line doesn't fit */
+    output.context = &line;
+    output.used = 0;
+    output.error = 0;
+    output.discard = 0;
+    output.buffer = malloc(OUTPUT_BUFFER);
+    reader = open_lines(data, 0, size);
+    if (output.buffer == NULL || reader == NULL) {
+        free(output.buffer);
+        if (reader != NULL)
+            close_lines(reader);
+        return 1;
+    }
+    while (1) {
+        input = reader->p;
+        c = next_line(reader, &p, &end);
+        if (c <= 0) {
+            if (c < 0)
+                output.error = 1;
+            else if (reader->p != input && found(context, input, reader->p - input, NULL, 0))
+                output.error = 1;   /* Only \r after last line */
+            if (c < 0 || size != 0)
+                break;
+            p = data;   /* Empty file still has a line */
+            end = data;
+        }
+        state.format_line(&state, p, end, &output);
+        if (line.used != 0) {
+            output_flush(&output);
+            if (output.error || found(context, input, reader->p - input, line.data, line.used))
+                output.error = 1;
+            line.used = 0;
+        } else if (found(context, input, reader->p - input, output.buffer, output.used)) {
+            output.error = 1;
+        }
+        output.used = 0;
+        if (output.error || size == 0)
+            break;
+    }
+    close_lines(reader);
+    free(output.buffer);
+    free(line.data);
+    return output.error;
+}
+
+/*
+ ** Write the token stream of a buffer
+ */
+int pretty6502_tokens(struct pretty6502_options *options, char *data, size_t size, pretty6502_sink sink, void *context)
+{
+    struct pretty6502_token_header header;
+    struct pretty6502_token token;
+    struct format_state state;
+    struct line_reader *reader;
+    struct output output;
+    char *p;
+    char *end;
+    char *input;
+    size_t line;
+    int c;
+    
+    pthread_once(&keyword_index_once, build_indexes);
+    if (start_state(&state, options))
+        return 1;
+    output.sink = sink;
+    output.context = context;
+    output.used = 0;
+    output.error = 0;
+    output.discard = 0;
+    output.buffer = malloc(OUTPUT_BUFFER);
+    reader = open_lines(data, 0, size);
+    if (output.buffer == NULL || reader == NULL) {
+        free(output.buffer);
+        if (reader != NULL)
+            close_lines(reader);
+        return 1;
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PRETTY6502_TOKENS_MAGIC, sizeof(header.magic));
+    header.version = PRETTY6502_TOKENS_VERSION;
+    header.header_size = sizeof(header);
+    header.record_size = sizeof(token);
+    header.processor = options->dialect != NULL ? -1 : options->processor;
+    output_bytes(&output, (char *) &header, sizeof(header));
+    line = 1;
+    while (!output.error) {
+        input = reader->p;
+        c = next_line(reader, &p, &end);
+        if (c <= 0) {
+            if (c < 0)
+                output.error = 1;
+            break;
+        }
+        memset(&token, 0, sizeof(token));
+        token.offset = input - data;
+        token.line = line++;
+        if (p != input)     /* Copied without \r */
+            token.flags = PRETTY6502_TOKEN_CR;
+        STAT_PRESCAN(1);
+        token_line(&state, p, end, &token);
+        STAT_PRESCAN(0);
+        output_bytes(&output, (char *) &token, sizeof(token));
+    }
+    close_lines(reader);
+    output_flush(&output);
+    free(output.buffer);
+    return output.error;
+}
+
+/*
+ ** Report the files included by a buffer
+ */
+int pretty6502_includes(struct pretty6502_options *options, char *data, size_t size, pretty6502_include found, void *context)
+{
+    struct format_state state;
+    struct line_reader *reader;
+    char *p;
+    char *end;
+    char *name;
+    size_t length;
+    int c;
+    
+    pthread_once(&keyword_index_once, build_indexes);
+    if (start_state(&state, options))
+        return 1;
+    reader = open_lines(data, 0, size);
+    if (reader == NULL)
+        return 1;
+    STAT_PRESCAN(1);
+    while ((c = next_line(reader, &p, &end)) > 0) {
+        length = line_include(&state, p, end, &name);
+        if (length != 0)
+            found(context, name, length);
+    }
+    STAT_PRESCAN(0);
+    close_lines(reader);
+    return c < 0;
+}
+
+/*
+ ** Variants
+ **
+ ** The lines are split in fields once, and then each variant is
+ ** formatted by its own thread from the fields (only the layout and
+ ** the case change between variants). The lines with \r are kept
+ ** without them in a separate buffer.
+ */
+struct parsed_line {
+    struct pretty6502_token token;  /* Offset in copies with PRETTY6502_TOKEN_CR */
+    int fields;
+};
+
+struct parsed {
+    char *data;
+    struct parsed_line *lines;
+    size_t count;
+    size_t size;
+    struct memory_sink copies;
+};
+
+struct variant {
+    struct pretty6502_options *options;
+    struct parsed *parsed;
+    pretty6502_sink sink;
+    void *context;
+    pthread_t thread;
+    int started;
+    int error;
+};
+
+/*
+ ** Add a line to the parsed buffer, returns zero if successful
+ */
+static int parse_line(struct parsed *parsed, struct format_state *state, char *input, char *p, char *end)
+{
+    struct parsed_line *line;
+    
+    if (parsed->count == parsed->size) {
+        parsed->size = parsed->size ? parsed->size * 2 : 1024;
+        line = realloc(parsed->lines, parsed->size * sizeof(struct parsed_line));
+        if (line == NULL)
+            return 1;
+        parsed->lines = line;
+    }
+    line = &parsed->lines[parsed->count++];
+    memset(&line->token, 0, sizeof(line->token));
+    line->fields = token_line(state, p, end, &line->token);
+    if (p == input) {
+        line->token.offset = p - parsed->data;
+    } else {    /* Copied without \r, it must outlive the scratch */
+        line->token.offset = parsed->copies.used;
+        line->token.flags |= PRETTY6502_TOKEN_CR;
+        if (write_memory(&parsed->copies, p, end - p) || write_memory(&parsed->copies, "\n", 1))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ ** Format a line already split in fields (same as format_kernel())
+ */
+static void layout_line(struct format_state *state, char *p, struct parsed_line *line, struct output *output)
+{
+    struct pretty6502_options *options;
+    struct pretty6502_token *token;
+    char *p1;
+    int current_column;
+    int request;
+    int indent;
+    int something;
+    
+    options = state->options;
+    token = &line->token;
+    output_bytes(output, p, token->label_length);
+    current_column = token->label_length;
+    something = token->label_length != 0;
+    indent = token->level * options->nesting_space;
+    if (line->fields & SPLIT_MNEMONIC) {
+        if (token->keyword > 0 && (token->flags & DONT_RELOCATE_LABEL))
+            request = options->start_operand;
+        else
+            request = options->start_mnemonic;
+        if (current_column != 0 && options->labels_own_line != 0 && (token->flags & DONT_RELOCATE_LABEL) == 0) {
+            output_char(output, '\n');
+            current_column = 0;
+        }
+        request += indent;
+        request_space(output, options->tabs, &current_column, request, 1);
+        something = 1;
+        p1 = p + token->mnemonic;
+        write_case(output, p1, p1 + token->mnemonic_length, token->keyword <= 0 ? options->mnemonics_case : options->directives_case);
+        current_column += token->mnemonic_length;
+        if (line->fields & SPLIT_OPERAND) {
+            if (state->index->dialect == DIALECT_TMS9900)
+                request = current_column + 1;
+            else
+                request = options->start_operand + indent;
+            request_space(output, options->tabs, &current_column, request, 1);
+            output_bytes(output, p + token->operand, token->operand_length);
+            current_column += token->operand_length;
+        }
+    }
+    if (line->fields & SPLIT_COMMENT) {
+        p1 = p + token->comment;
+        if (state->index->dialect == DIALECT_TMS9900 && !something && *p1 == '*') {
+            request = 0;
+        } else if (!something && (int) token->comment == state->prev_comment_original_location) {
+            request = state->prev_comment_final_location;
+        } else {
+            state->prev_comment_original_location = token->comment;
+            if (current_column == 0)
+                request = 0;
+            else if (current_column < options->start_mnemonic + indent)
+                request = options->start_mnemonic + indent;
+            else
+                request = options->start_comment + indent;
+            if (current_column == 0 && options->align_comment == 1)
+                request = options->start_mnemonic + indent;
+            state->prev_comment_final_location = request;
+        }
+        request_space(output, options->tabs, &current_column, request, (*p1 == ';') ? 0 : 2);
+        output_bytes(output, p1, token->comment_length);
+    } else if (!something) {
+        state->prev_comment_original_location = 0;
+        state->prev_comment_final_location = 0;
+    }
+    output_char(output, '\n');
+}
+
+/*
+ ** Format a variant from the parsed lines
+ */
+static void *variant_worker(void *arg)
+{
+    struct variant *variant = arg;
+    struct parsed *parsed = variant->parsed;
+    struct parsed_line *line;
+    struct format_state state;
+    struct output output;
+    char *p;
+    size_t c;
+    
+    output.sink = variant->sink;
+    output.context = variant->context;
+    output.used = 0;
+    output.error = 0;
+    output.discard = 0;
+    output.buffer = malloc(OUTPUT_BUFFER);
+    if (output.buffer == NULL || start_state(&state, variant->options)) {
+        free(output.buffer);
+        variant->error = 1;
+        return NULL;
+    }
+    for (c = 0; c < parsed->count && !output.error; c++) {
+        line = &parsed->lines[c];
+        if (line->token.flags & PRETTY6502_TOKEN_CR)
+            p = parsed->copies.data + line->token.offset;
+        else
+            p = parsed->data + line->token.offset;
+        layout_line(&state, p, line, &output);
+    }
+    output_flush(&output);
+    free(output.buffer);
+    variant->error = output.error;
+    return NULL;
+}
+
+/*
+ ** Format a buffer with several options splitting its lines once
+ */
+int pretty6502_format_variants(struct pretty6502_options *options, int count, char *data, size_t size, pretty6502_sink *sinks, void **contexts)
+{
+    struct format_state state;
+    struct line_reader *reader;
+    struct variant *variants;
+    struct parsed parsed;
+    char *input;
+    char *p;
+    char *end;
+    int error;
+    int c;
+    
+    for (c = 1; c < count; c++) {
+        if (options[c].processor != options[0].processor || options[c].dialect != options[0].dialect)
+            return 1;
+    }
+    pthread_once(&keyword_index_once, build_indexes);
+    if (count <= 0 || start_state(&state, &options[0]))
+        return 1;
+    reader = open_lines(data, 0, size);
+    if (reader == NULL)
+        return 1;
+    memset(&parsed, 0, sizeof(parsed));
+    parsed.data = data;
+    error = 0;
+    while (!error) {
+        input = reader->p;
+        c = next_line(reader, &p, &end);
+        if (c <= 0) {
+            error = c < 0;
+            break;
+        }
+        error = parse_line(&parsed, &state, input, p, end);
+    }
+    close_lines(reader);
+    if (!error && size == 0)    /* Empty file still has a line */
+        error = parse_line(&parsed, &state, data, data, data);
+    variants = error ? NULL : calloc(count, sizeof(struct variant));
+    if (variants != NULL) {
+        for (c = 0; c < count; c++) {
+            variants[c].options = &options[c];
+            variants[c].parsed = &parsed;
+            variants[c].sink = sinks[c];
+            variants[c].context = contexts[c];
+        }
+        for (c = 1; c < count; c++)     /* The first one goes in this thread */
+            variants[c].started = pthread_create(&variants[c].thread, NULL, variant_worker, &variants[c]) == 0;
+        variant_worker(&variants[0]);
+        for (c = 0; c < count; c++) {
+            if (variants[c].started)
+                pthread_join(variants[c].thread, NULL);
+            else if (c != 0)    /* Without thread */
+                variant_worker(&variants[c]);
+            error |= variants[c].error;
+        }
+        free(variants);
+    } else {
+        error = 1;
+    }
+    free(parsed.lines);
+    free(parsed.copies.data);
+    return error;
+}
+
+/*
+ ** Parallel formatting
+ **
+ ** The input is split in parts at line boundaries. The nesting level
+ ** after a part is max(level - drops, 0) + rises, so all the parts
+ ** are scanned at the same time for their drops and rises, and the
+ ** level at the start of each one comes from adding them in order.
+ ** Then the parts are formatted at the same time into memory, each
+ ** one starting without previous comment.
+ **
+ ** If a part should start with a previous comment, its first lines
+ ** are formatted again with it, and also without it only to follow
+ ** the state, until both states are the same. From there the output
+ ** already made for the part is right.
+ */
+#define PARALLEL_PART   1048576     /* Minimum size of a part */
+#define PARALLEL_PARTS  256         /* Maximum number of parts */
+
+struct part {
+    size_t start;
+    size_t stop;
+    int drops;          /* Levels closed below the starting one */
+    int rises;          /* Levels open at the end */
+    int level;          /* Level at start */
+    struct format_state state;  /* State at end (started without comment) */
+    struct memory_sink memory;  /* Formatted part */
+    int error;
+};
+
+struct parallel {
+    struct pretty6502_options *options;
+    char *data;
+    struct part *parts;
+    int count;
+    int next;           /* Next part to take (atomic) */
+    int phase;          /* 0 = scan levels, 1 = format */
+};
+
+/*
+ ** Scan the nesting levels of a part
+ */
+static void scan_part(struct parallel *parallel, struct part *part)
+{
+    struct format_state state;
+    struct line_reader *reader;
+    char *p;
+    char *end;
+    int flags;
+    int level;
+    int c;
+    
+    start_state(&state, parallel->options);
+    reader = open_lines(parallel->data, part->start, part->stop);
+    if (reader == NULL) {
+        part->error = 1;
+        return;
+    }
+    level = 0;
+    STAT_PRESCAN(1);
+    while ((c = next_line(reader, &p, &end)) > 0) {
+        flags = line_flags(&state, p, end);
+        if (flags & LEVEL_OUT) {    /* Same order as format_kernel() */
+            if (level > 0)
+                level--;
+            else
+                part->drops++;
+        }
+        if (flags & LEVEL_IN)
+            level++;
+    }
+    STAT_PRESCAN(0);
+    if (c < 0)
+        part->error = 1;
+    part->rises = level;
+    close_lines(reader);
+}
+
+/*
+ ** Format a part into memory
+ */
+static void format_part(struct parallel *parallel, struct part *part)
+{
+    struct output output;
+    struct line_reader *reader;
+    char *p;
+    char *end;
+    int c;
+    
+    start_state(&part->state, parallel->options);
+    part->state.current_level = part->level;
+    part->memory.size = part->stop - part->start + (part->stop - part->start) / 4 + 256;
+    part->memory.used = 0;
+    part->memory.data = malloc(part->memory.size);
+    output.sink = write_memory;
+    output.context = &part->memory;
+    output.used = 0;
+    output.error = 0;
+    output.discard = 0;
+    output.buffer = malloc(OUTPUT_BUFFER);
+    reader = open_lines(parallel->data, part->start, part->stop);
+    c = 0;
+    if (part->memory.data == NULL || output.buffer == NULL || reader == NULL) {
+        part->error = 1;
+    } else {
+        while (!output.error && (c = next_line(reader, &p, &end)) > 0)
+            part->state.format_line(&part->state, p, end, &output);
+        if (c < 0)
+            output.error = 1;
+        output_flush(&output);
+        part->error = output.error;
+    }
+    if (reader != NULL)
+        close_lines(reader);
+    free(output.buffer);
+}
+
+/*
+ ** Sink that only counts
+ */
+static int count_bytes(void *context, char *data, size_t length)
+{
+    (void) data;
+    *(size_t *) context += length;
+    return 0;
+}
+
+/*
+ ** Write a part starting with the previous comment of state,
+ ** updating it
+ */
+static void write_part(struct parallel *parallel, struct part *part, struct format_state *state, struct output *output)
+{
+    struct format_state empty;
+    struct output counter;
+    struct line_reader *reader;
+    size_t counted;
+    char *p;
+    char *end;
+    int c;
+    
+    if (state->prev_comment_original_location == 0 && state->prev_comment_final_location == 0) {
+        output_flush(output);
+        if (!output->error && part->memory.used != 0)
+            output->error = output->sink(output->context, part->memory.data, part->memory.used);
+        state->prev_comment_original_location = part->state.prev_comment_original_location;
+        state->prev_comment_final_location = part->state.prev_comment_final_location;
+        return;
+    }
+    state->current_level = part->level;
+    start_state(&empty, parallel->options);
+    empty.current_level = part->level;
+    counted = 0;
+    counter.sink = count_bytes;
+    counter.context = &counted;
+    counter.used = 0;
+    counter.error = 0;
+    counter.discard = 0;
+    counter.buffer = malloc(OUTPUT_BUFFER);
+    reader = open_lines(parallel->data, part->start, part->stop);
+    c = 0;
+    if (counter.buffer == NULL || reader == NULL) {
+        output->error = 1;
+    } else {
+        STAT_PRESCAN(1);   /* Lines already counted by format_part() */
+        while (!output->error && (c = next_line(reader, &p, &end)) > 0) {
+            state->format_line(state, p, end, output);
+            empty.format_line(&empty, p, end, &counter);
+            if (state->prev_comment_original_location == empty.prev_comment_original_location
+            && state->prev_comment_final_location == empty.prev_comment_final_location) {
+                counted += counter.used;    /* Now the same as the part */
+                output_flush(output);
+                if (!output->error && part->memory.used != counted)
+                    output->error = output->sink(output->context, part->memory.data + counted, part->memory.used - counted);
+                state->prev_comment_original_location = part->state.prev_comment_original_location;
+                state->prev_comment_final_location = part->state.prev_comment_final_location;
+                break;
+            }
+        }
+        STAT_PRESCAN(0);
+        if (c < 0)
+            output->error = 1;
+    }
+    if (reader != NULL)
+        close_lines(reader);
+    free(counter.buffer);
+}
+
+/*
+ ** Thread for parallel formatting
+ */
+static void *parallel_worker(void *arg)
+{
+    struct parallel *parallel = arg;
+    int c;
+    
+    while ((c = __atomic_fetch_add(&parallel->next, 1, __ATOMIC_RELAXED)) < parallel->count) {
+        if (parallel->phase == 0)
+            scan_part(parallel, &parallel->parts[c]);
+        else
+            format_part(parallel, &parallel->parts[c]);
+    }
+    return NULL;
+}
+
+/*
+ ** Run a phase over all parts with the given threads
+ */
+static void run_phase(struct parallel *parallel, int phase, int threads)
+{
+    pthread_t thread[PARALLEL_PARTS];
+    int started;
+    
+    parallel->phase = phase;
+    parallel->next = 0;
+    for (started = 0; started < threads - 1; started++) {
+        if (pthread_create(&thread[started], NULL, parallel_worker, parallel) != 0)
+            break;  /* Work anyway with less threads */
+    }
+    parallel_worker(parallel);
+    while (started > 0)
+        pthread_join(thread[--started], NULL);
+}
+
+/*
+ ** Format a buffer using several threads
+ */
+int pretty6502_format_parallel(struct pretty6502_options *options, char *data, size_t size, int threads, pretty6502_sink sink, void *context)
+{
+    struct parallel parallel;
+    struct format_state state;
+    struct output output;
+    struct part *part;
+    char *p;
+    size_t count;
+    size_t c;
+    
+    count = size / PARALLEL_PART;
+    if (threads < 1)
+        threads = 1;
+    if (count > (size_t) threads)
+        count = threads;
+    if (count > PARALLEL_PARTS)
+        count = PARALLEL_PARTS;
+    if (count <= 1)
+        return pretty6502_format(options, data, size, sink, context);
+    pthread_once(&keyword_index_once, build_indexes);
+    if (start_state(&state, options))
+        return 1;
+    parallel.options = options;
+    parallel.data = data;
+    parallel.count = count;
+    parallel.parts = calloc(count, sizeof(struct part));
+    if (parallel.parts == NULL)
+        return 1;
+    
+    /*
+     ** Split at line boundaries
+     */
+    for (c = 0; c < count; c++) {
+        part = &parallel.parts[c];
+        part->start = c == 0 ? 0 : parallel.parts[c - 1].stop;
+        part->stop = size;
+        if (c < count - 1 && size / count * (c + 1) > part->start) {
+            p = memchr(data + size / count * (c + 1), '\n', size - size / count * (c + 1));
+            if (p != NULL)
+                part->stop = p + 1 - data;
+        }
+    }
+    
+    /*
+     ** Nesting levels
+     */
+    run_phase(&parallel, 0, count);
+    for (c = 1; c < count; c++) {
+        part = &parallel.parts[c - 1];
+        parallel.parts[c].level = (part->level > part->drops ? part->level - part->drops : 0) + part->rises;
+    }
+    
+    /*
+     ** Format and join
+     */
+    run_phase(&parallel, 1, count);
+    output.sink = sink;
+    output.context = context;
+    output.used = 0;
+    output.error = 0;
+    output.discard = 0;
+    output.buffer = malloc(OUTPUT_BUFFER);
+    if (output.buffer == NULL)
+        output.error = 1;
+    for (c = 0; c < count; c++) {
+        if (parallel.parts[c].error)
+            output.error = 1;
+    }
+    for (c = 0; c < count && !output.error; c++)
+        write_part(&parallel, &parallel.parts[c], &state, &output);
+    if (output.buffer != NULL)
+        output_flush(&output);
+    for (c = 0; c < count; c++)
+        free(parallel.parts[c].memory.data);
+    free(parallel.parts);
+    free(output.buffer);
+    return output.error;
+}
+
+/*
+ ** Compile a dialect definition into an index file
+ **
+ ** The definition has one statement per line, ';' starts a comment:
+ **
+ **     kind dotted             unknown, plain, dotted, or tms9900
+ **     base 1                  keywords of a processor (as -p1)
+ **     directive if in         flags: in, out, minus, label
+ **     mnemonic adc and asl    any number of mnemonics
+ **     literals char af        apostrophe rules: afpair, char, af
+ **
+ ** The first time a keyword appears is the one used.
+ */
+int pretty6502_compile_dialect(char *source, char *target, char *message)
+{
+    static char *kinds[] = {"unknown", "plain", "dotted", "tms9900", NULL};
+    static char *flag_names[] = {"label", "in", "out", "minus", "include", NULL};
+    static int flag_values[] = {DONT_RELOCATE_LABEL, LEVEL_IN, LEVEL_OUT, LEVEL_MINUS, INCLUDE_FILE};
+    static char *literal_names[] = {"afpair", "char", "af", NULL};
+    static int literal_values[] = {LITERAL_AF_PAIR, LITERAL_CHAR, LITERAL_AF_PRIME};
+    struct pretty6502_dialect *index;
+    FILE *input;
+    FILE *output;
+    char line[1024];
+    char *word;
+    char *p;
+    int line_number;
+    int kind;
+    int flags;
+    int c;
+    
+    pthread_once(&keyword_index_once, build_indexes);
+    input = fopen(source, "r");
     if (input == NULL) {
-        fprintf(stderr, "Unable to open input file: %s\n", argv[c]);
+        sprintf(message, "Unable to open dialect file: %.200s", source);
+        return 1;
+    }
+    index = new_index(DIALECT_PLAIN);
+    if (index == NULL) {
+        fclose(input);
+        sprintf(message, "Unable to allocate memory");
+        return 1;
+    }
+    kind = -1;
+    line_number = 0;
+    while (fgets(line, sizeof(line), input) != NULL) {
+        line_number++;
+        p = strchr(line, ';');
+        if (p != NULL)
+            *p = '\0';
+        word = strtok(line, " \t\r\n");
+        if (word == NULL)
+            continue;
+        if (strcmp(word, "kind") == 0) {
+            word = strtok(NULL, " \t\r\n");
+            for (c = 0; kinds[c] != NULL; c++) {
+                if (word != NULL && strcmp(word, kinds[c]) == 0)
+                    break;
+            }
+            if (kinds[c] == NULL) {
+                sprintf(message, "%.200s:%d: bad kind", source, line_number);
+                break;
+            }
+            kind = c;
+        } else if (strcmp(word, "base") == 0) {
+            word = strtok(NULL, " \t\r\n");
+            c = word != NULL ? atoi(word) : -1;
+            if (c <= P_UNK || c >= P_UNSUPPORTED) {
+                sprintf(message, "%.200s:%d: bad processor code", source, line_number);
+                break;
+            }
+            if (kind < 0)
+                kind = processor_dialect(c);
+            if (add_processor(&index, c)) {
+                sprintf(message, "%.200s:%d: too many keywords", source, line_number);
+                break;
+            }
+        } else if (strcmp(word, "directive") == 0) {
+            word = strtok(NULL, " \t\r\n");
+            if (word == NULL) {
+                sprintf(message, "%.200s:%d: missing directive", source, line_number);
+                break;
+            }
+            flags = 0;
+            while ((p = strtok(NULL, " \t\r\n")) != NULL) {
+                for (c = 0; flag_names[c] != NULL; c++) {
+                    if (strcmp(p, flag_names[c]) == 0)
+                        break;
+                }
+                if (flag_names[c] == NULL)
+                    break;
+                flags |= flag_values[c];
+            }
+            if (p != NULL) {
+                sprintf(message, "%.200s:%d: bad flag %.20s", source, line_number, p);
+                break;
+            }
+            if (add_keyword(&index, word, strlen(word), 1, flags)) {
+                sprintf(message, "%.200s:%d: too many keywords", source, line_number);
+                break;
+            }
+        } else if (strcmp(word, "literals") == 0) {
+            index->literals = 0;
+            while ((p = strtok(NULL, " \t\r\n")) != NULL) {
+                for (c = 0; literal_names[c] != NULL; c++) {
+                    if (strcmp(p, literal_names[c]) == 0)
+                        break;
+                }
+                if (literal_names[c] == NULL)
+                    break;
+                index->literals |= literal_values[c];
+            }
+            if (p != NULL) {
+                sprintf(message, "%.200s:%d: bad literal rule %.20s", source, line_number, p);
+                break;
+            }
+        } else if (strcmp(word, "mnemonic") == 0) {
+            while ((word = strtok(NULL, " \t\r\n")) != NULL) {
+                if (add_keyword(&index, word, strlen(word), 0, 0))
+                    break;
+            }
+            if (word != NULL) {
+                sprintf(message, "%.200s:%d: too many keywords", source, line_number);
+                break;
+            }
+        } else {
+            sprintf(message, "%.200s:%d: unknown statement %.20s", source, line_number, word);
+            break;
+        }
+    }
+    if (!feof(input)) {
+        fclose(input);
+        free(index);
+        return 1;
+    }
+    fclose(input);
+    if (kind >= 0)
+        index->dialect = kind;
+    output = fopen(target, "wb");
+    if (output == NULL) {
+        free(index);
+        sprintf(message, "Unable to open index file: %.200s", target);
+        return 1;
+    }
+    c = fwrite(index, 1, index->size, output) != index->size;
+    if (fclose(output) != 0)
+        c = 1;
+    free(index);
+    if (c) {
+        sprintf(message, "Unable to write index file: %.200s", target);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ ** Load a compiled dialect, it is mapped in memory as is
+ */
+struct pretty6502_dialect *pretty6502_load_dialect(char *name, char *message)
+{
+    struct pretty6502_dialect *index;
+    struct keyword *keyword;
+    struct stat info;
+    int fd;
+    int count;
+    int c;
+    
+    pthread_once(&keyword_index_once, build_indexes);
+    fd = open(name, O_RDONLY);
+    if (fd < 0) {
+        sprintf(message, "Unable to open index file: %.200s", name);
+        return NULL;
+    }
+    if (fstat(fd, &info) != 0 || info.st_size < (off_t) sizeof(struct pretty6502_dialect)) {
+        close(fd);
+        sprintf(message, "Not a dialect index: %.200s", name);
+        return NULL;
+    }
+    index = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (index == MAP_FAILED) {
+        sprintf(message, "Unable to map index file: %.200s", name);
+        return NULL;
+    }
+    
+    /*
+     ** Validate all the offsets once, so searching needs no checks
+     */
+    count = 0;
+    for (c = 0; c < INDEX_SIZE; c++) {
+        keyword = &index->keywords[c];
+        if (keyword->name == 0)
+            continue;
+        if (keyword->name < sizeof(struct pretty6502_dialect) || keyword->length <= 0
+        || keyword->length >= info.st_size - keyword->name
+        || KEYWORD_NAME(index, keyword)[keyword->length] != '\0')
+            break;
+        count++;
+    }
+    if (memcmp(index->magic, INDEX_MAGIC, sizeof(index->magic)) != 0
+    || index->version != INDEX_VERSION || index->size != info.st_size
+    || index->dialect < DIALECT_UNKNOWN || index->dialect > DIALECT_TMS9900
+    || c < INDEX_SIZE || count != index->count || count >= INDEX_SIZE) {
+        munmap(index, info.st_size);
+        sprintf(message, "Not a dialect index: %.200s", name);
+        return NULL;
+    }
+    return index;
+}
+
+/*
+ ** Release a dialect loaded with pretty6502_load_dialect()
+ */
+void pretty6502_free_dialect(struct pretty6502_dialect *dialect)
+{
+    munmap(dialect, dialect->size);
+}
+
+#ifndef PRETTY6502_LIBRARY
+
+size_t first_line = 1;          /* First line to output */
+size_t last_line = (size_t) -1; /* Last line to output */
+int check_mode;                 /* Only check files are formatted */
+int diff_mode;                  /* Show the changes as unified diff (--diff) */
+char *tokens_name;              /* Token stream output (--tokens) */
+char *xref_name;                /* Label cross-reference output (--xref) */
+struct pretty6502_options *variant_options;     /* Variants (--variant) */
+char **variant_names;
+int variant_count;
+char *daemon_socket;            /* Format through this daemon (--connect) */
+char *dialect_name;             /* Full path of --dialect */
+
+int remote_format(struct pretty6502_options *options, char *data, size_t size, size_t first, size_t last, pretty6502_sink sink, void *context);
+
+/*
+ ** Format through the daemon if there is one
+ */
+int format_lines(struct pretty6502_options *options, char *data, size_t size, size_t first, size_t last, pretty6502_sink sink, void *context)
+{
+    if (daemon_socket != NULL)
+        return remote_format(options, data, size, first, last, sink, context);
+    return pretty6502_format_lines(options, data, size, first, last, sink, context);
+}
+
+/*
+ ** Report of --stats
+ **
+ ** Times are added from every thread, so with several jobs they can
+ ** be more than the wall time. The formatting time is the time busy
+ ** with each file minus the other phases. The counters of the hot
+ ** paths are only available if compiled with PRETTY6502_STATS.
+ */
+int stats_mode;                 /* 1 = human readable, 2 = JSON */
+unsigned long long stats_start;
+unsigned long long stats_read;  /* Nanoseconds */
+unsigned long long stats_write;
+unsigned long long stats_busy;
+unsigned long long stats_files;
+unsigned long long stats_bytes;
+unsigned long long stats_lines;
+
+/*
+ ** Add to a statistic from any thread
+ */
+void stats_add(unsigned long long *counter, unsigned long long value)
+{
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+/*
+ ** Count the lines of an input
+ */
+unsigned long long count_lines(char *data, size_t size)
+{
+    unsigned long long lines;
+    char *p;
+    char *end;
+    
+    lines = 0;
+    end = data + size;
+    for (p = data; (p = memchr(p, '\n', end - p)) != NULL; p++)
+        lines++;
+    if (size > 0 && data[size - 1] != '\n')
+        lines++;
+    return lines;
+}
+
+/*
+ ** Print the statistics when exiting
+ */
+void stats_report(void)
+{
+    struct rusage usage;
+    double wall;
+    double normalize;
+    double format;
+#ifdef PRETTY6502_STATS
+    char *name[] = {"empty", "comment", "label", "mnemonic", "directive", "unknown"};
+    int c;
+#endif
+    
+    wall = (clock_nanoseconds() - stats_start) / 1e9;
+    if (wall <= 0)
+        wall = 1e-9;
+#ifdef PRETTY6502_STATS
+    normalize = statistics.normalize / 1e9;
+#else
+    normalize = 0;
+#endif
+    format = (stats_busy - stats_read - stats_write) / 1e9 - normalize;
+    if (stats_busy < stats_read + stats_write || format < 0)
+        format = 0;
+    getrusage(RUSAGE_SELF, &usage);
+    if (stats_mode == 2) {
+        fprintf(stderr, "{\"wall\": %.6f, \"read\": %.6f, ", wall, stats_read / 1e9);
+#ifdef PRETTY6502_STATS
+        fprintf(stderr, "\"normalize\": %.6f, ", normalize);
+#else
+        fprintf(stderr, "\"normalize\": null, ");
+#endif
+        fprintf(stderr, "\"format\": %.6f, \"write\": %.6f, ", format, stats_write / 1e9);
+        fprintf(stderr, "\"files\": %llu, \"bytes\": %llu, \"lines\": %llu, ", stats_files, stats_bytes, stats_lines);
+        fprintf(stderr, "\"bytes_per_second\": %.0f, \"lines_per_second\": %.0f, ", stats_bytes / wall, stats_lines / wall);
+        fprintf(stderr, "\"peak_rss_kb\": %ld, \"counters\": ", usage.ru_maxrss);
+#ifdef PRETTY6502_STATS
+        fprintf(stderr, "{\"opcode_directive\": %llu, \"opcode_mnemonic\": %llu, \"opcode_unknown\": %llu, ", statistics.directives, statistics.mnemonics, statistics.unknown);
+        fprintf(stderr, "\"comparisons\": %llu, \"comment_present\": %llu, \"lines\": {", statistics.comparisons, statistics.comments);
+        for (c = 0; c < LINE_TYPES; c++)
+            fprintf(stderr, "%s\"%s\": %llu", c ? ", " : "", name[c], statistics.lines[c]);
+        fprintf(stderr, "}}}\n");
+#else
+        fprintf(stderr, "null}\n");
+#endif
+        return;
+    }
+    fprintf(stderr, "Statistics:\n");
+    fprintf(stderr, "    Wall time        %10.3f s\n", wall);
+    fprintf(stderr, "    Read             %10.3f s\n", stats_read / 1e9);
+#ifdef PRETTY6502_STATS
+    fprintf(stderr, "    Normalization    %10.3f s\n", normalize);
+#endif
+    fprintf(stderr, "    Formatting       %10.3f s\n", format);
+    fprintf(stderr, "    Write            %10.3f s\n", stats_write / 1e9);
+    fprintf(stderr, "    Files            %10llu\n", stats_files);
+    fprintf(stderr, "    Bytes            %10llu (%.1f MB/s)\n", stats_bytes, stats_bytes / wall / 1e6);
+    fprintf(stderr, "    Lines            %10llu (%.0f lines/s)\n", stats_lines, stats_lines / wall);
+    fprintf(stderr, "    Peak RSS         %10ld KB\n", usage.ru_maxrss);
+#ifdef PRETTY6502_STATS
+    fprintf(stderr, "    Opcode searches  %10llu directive, %llu mnemonic, %llu unknown\n", statistics.directives, statistics.mnemonics, statistics.unknown);
+    fprintf(stderr, "    Comparisons      %10llu\n", statistics.comparisons);
+    fprintf(stderr, "    Comment checks   %10llu\n", statistics.comments);
+    fprintf(stderr, "    Lines by type   ");
+    for (c = 0; c < LINE_TYPES; c++)
+        fprintf(stderr, "%s %llu %s", c ? "," : "", statistics.lines[c], name[c]);
+    fprintf(stderr, "\n");
+#else
+    fprintf(stderr, "    (Counters need a build with make stats)\n");
+#endif
+}
+
+/*
+ ** Read a file into memory
+ */
+char *read_file(char *name, size_t *allocation, char *message)
+{
+    FILE *input;
+    char *data;
+    off_t size;
+    
+    input = fopen(name, "rb");
+    if (input == NULL) {
+        sprintf(message, "Unable to open input file: %.200s", name);
+        return NULL;
+    }
+    fseeko(input, 0, SEEK_END);
+    size = ftello(input);
+    if (size < 0 || (unsigned long long) size >= (size_t) -1) {
+        sprintf(message, "Something went wrong reading the input file");
+        fclose(input);
+        return NULL;
+    }
+    *allocation = size;
+    data = malloc(*allocation + sizeof(char));
+    if (data == NULL) {
+        sprintf(message, "Unable to allocate memory");
+        fclose(input);
+        return NULL;
+    }
+    fseeko(input, 0, SEEK_SET);
+    if (fread(data, sizeof(char), *allocation, input) != *allocation) {
+        sprintf(message, "Something went wrong reading the input file");
+        fclose(input);
+        free(data);
+        return NULL;
+    }
+    fclose(input);
+    return data;
+}
+
+/*
+ ** Input file
+ */
+struct input_file {
+    char *data;
+    size_t size;
+    int mapped;     /* Indicates if mapped in memory */
+};
+
+/*
+ ** Read a whole stream into memory, returns zero if successful
+ */
+int read_stream(int fd, struct input_file *input, char *message)
+{
+    char *new_data;
+    size_t allocation;
+    ssize_t length;
+    
+    allocation = 65536;
+    input->data = malloc(allocation);
+    input->size = 0;
+    input->mapped = 0;
+    while (input->data != NULL) {
+        if (input->size == allocation) {
+            allocation *= 2;
+            new_data = realloc(input->data, allocation);
+            if (new_data == NULL)
+                break;
+            input->data = new_data;
+        }
+        length = read(fd, input->data + input->size, allocation - input->size);
+        if (length < 0 && errno == EINTR)
+            continue;
+        if (length < 0) {
+            sprintf(message, "Something went wrong reading the input file");
+            free(input->data);
+            input->data = NULL;
+            return 1;
+        }
+        if (length == 0)
+            return 0;
+        input->size += length;
+    }
+    sprintf(message, "Unable to allocate memory");
+    free(input->data);
+    input->data = NULL;
+    return 1;
+}
+
+/*
+ ** Open input file (- for standard input)
+ **
+ ** The file is mapped in memory so it is never copied, if this
+ ** isn't possible (or copy is set because the same file will be
+ ** written) then it is read into a buffer.
+ */
+int read_input(char *name, struct input_file *input, int copy, char *message)
+{
+    struct stat info;
+    int fd;
+    int error;
+    
+    input->data = NULL;
+    input->size = 0;
+    input->mapped = 0;
+    if (strcmp(name, "-") == 0)
+        return read_stream(0, input, message);
+    fd = open(name, O_RDONLY);
+    if (fd < 0) {
+        sprintf(message, "Unable to open input file: %.200s", name);
+        return 1;
+    }
+    if (fstat(fd, &info) == 0 && !S_ISREG(info.st_mode)) {  /* Pipe or device */
+        error = read_stream(fd, input, message);
+        close(fd);
+        return error;
+    }
+    if (!copy && fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0 && (unsigned long long) info.st_size < (size_t) -1) {
+        input->data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (input->data != MAP_FAILED) {
+            close(fd);
+            input->size = info.st_size;
+            input->mapped = 1;
+            madvise(input->data, input->size, MADV_SEQUENTIAL);
+            return 0;
+        }
+    }
+    close(fd);
+    input->data = read_file(name, &input->size, message);
+    if (input->data == NULL)
+        return 1;
+    return 0;
+}
+
+/*
+ ** Open input file, accounting it for --stats
+ */
+int open_input(char *name, struct input_file *input, int copy, char *message)
+{
+    unsigned long long start;
+    int error;
+    
+    if (!stats_mode)
+        return read_input(name, input, copy, message);
+    start = clock_nanoseconds();
+    error = read_input(name, input, copy, message);
+    stats_add(&stats_read, clock_nanoseconds() - start);
+    if (!error) {
+        stats_add(&stats_files, 1);
+        stats_add(&stats_bytes, input->size);
+        stats_add(&stats_lines, count_lines(input->data, input->size));
+    }
+    return error;
+}
+
+/*
+ ** Close input file
+ */
+void close_input(struct input_file *input)
+{
+    if (input->mapped)
+        munmap(input->data, input->size);
+    else
+        free(input->data);
+}
+
+/*
+ ** Write all the data to a file descriptor
+ */
+int write_data(int fd, char *data, size_t length)
+{
+    ssize_t written;
+    
+    while (length > 0) {
+        written = write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return 1;
+        }
+        data += written;
+        length -= written;
+    }
+    return 0;
+}
+
+/*
+ ** Sink for a file descriptor
+ */
+int write_file(void *context, char *data, size_t length)
+{
+    int fd = *(int *) context;
+    unsigned long long start;
+    int error;
+    
+    if (!stats_mode)
+        return write_data(fd, data, length);
+    start = clock_nanoseconds();
+    error = write_data(fd, data, length);
+    stats_add(&stats_write, clock_nanoseconds() - start);
+    return error;
+}
+
+/*
+ ** Open output file (- for standard output)
+ */
+int open_output(char *name, char *message)
+{
+    int fd;
+    
+    if (strcmp(name, "-") == 0)
+        return 1;
+    fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+        sprintf(message, "Unable to open output file: %.200s", name);
+    return fd;
+}
+
+/*
+ ** Close output file, returns zero if successful
+ */
+int close_output(int fd, int error, char *message)
+{
+    if (fd != 1 && close(fd) != 0)
+        error = 1;
+    if (error)
+        sprintf(message, "Something went wrong writing the output file");
+    return error;
+}
+
+int format_in_place(struct pretty6502_options *options, char *name, char *message);
+
+/*
+ ** Write the token stream of the input (--tokens), returns zero if
+ ** successful or else fills message
+ */
+int write_tokens(struct pretty6502_options *options, char *data, size_t size, char *message)
+{
+    int fd;
+    int error;
+    
+    fd = open_output(tokens_name, message);
+    if (fd < 0)
+        return 1;
+    error = pretty6502_tokens(options, data, size, write_file, &fd);
+    return close_output(fd, error, message);
+}
+
+/*
+ ** Write the label cross-reference of the input (--xref) formatting
+ ** it into the sink in the same pass, returns zero if successful or
+ ** else fills message
+ */
+int write_xref_file(struct pretty6502_options *options, char *data, size_t size, pretty6502_sink sink, void *context, char *message)
+{
+    int fd;
+    int error;
+    
+    fd = open_output(xref_name, message);
+    if (fd < 0)
+        return 1;
+    error = pretty6502_format_xref(options, data, size, sink, context, write_file, &fd);
+    return close_output(fd, error, message);
+}
+
+/*
+ ** Write the variants of the input (--variant), and the output with
+ ** the main options if the descriptor isn't -1. Returns zero if
+ ** successful or else fills message.
+ */
+int write_variants(struct pretty6502_options *options, char *input_name, char *data, size_t size, int output, char *message)
+{
+    struct pretty6502_options *all;
+    struct stat info1;
+    struct stat info2;
+    pretty6502_sink *sinks;
+    void **contexts;
+    int *fds;
+    int count;
+    int opened;
+    int error;
+    int c;
+    
+    count = variant_count + (output >= 0);
+    all = malloc(count * sizeof(struct pretty6502_options));
+    sinks = malloc(count * sizeof(pretty6502_sink));
+    contexts = malloc(count * sizeof(void *));
+    fds = malloc(count * sizeof(int));
+    if (all == NULL || sinks == NULL || contexts == NULL || fds == NULL) {
+        free(all);
+        free(sinks);
+        free(contexts);
+        free(fds);
+        sprintf(message, "Unable to allocate memory");
+        return 1;
+    }
+    error = 0;
+    for (c = 0; c < variant_count; c++) {
+        if (stat(input_name, &info1) == 0 && stat(variant_names[c], &info2) == 0 && info1.st_dev == info2.st_dev && info1.st_ino == info2.st_ino) {
+            sprintf(message, "Variant cannot replace the input file: %.200s", variant_names[c]);
+            error = 1;
+            break;
+        }
+        fds[c] = open_output(variant_names[c], message);
+        if (fds[c] < 0) {
+            error = 1;
+            break;
+        }
+        all[c] = variant_options[c];
+        sinks[c] = write_file;
+        contexts[c] = &fds[c];
+    }
+    opened = c;
+    if (!error) {
+        if (output >= 0) {
+            fds[c] = output;
+            all[c] = *options;
+            sinks[c] = write_file;
+            contexts[c] = &fds[c];
+        }
+        error = pretty6502_format_variants(all, count, data, size, sinks, contexts);
+        if (error)
+            sprintf(message, "Something went wrong writing the output file");
+    }
+    for (c = 0; c < opened; c++) {
+        if (close_output(fds[c], 0, message))
+            error = 1;
+    }
+    free(all);
+    free(sinks);
+    free(contexts);
+    free(fds);
+    return error;
+}
+
+/*
+ ** Process a file, returns zero if successful or else fills message
+ **
+ ** If output is the same file as input, it is formatted in place.
+ ** Without output only the token stream, the cross-reference and the
+ ** variants are written.
+ */
+int process_file(struct pretty6502_options *options, char *input_name, char *output_name, int jobs, char *message)
+{
+    struct input_file input;
+    struct stat info1;
+    struct stat info2;
+    int output;
+    int error;
+    int same;
+    
+    same = output_name != NULL && stat(input_name, &info1) == 0 && stat(output_name, &info2) == 0 && info1.st_dev == info2.st_dev && info1.st_ino == info2.st_ino;
+    if (same && S_ISREG(info1.st_mode) && first_line == 1 && last_line == (size_t) -1) {
+        if (tokens_name != NULL || xref_name != NULL || variant_count != 0) {
+            if (open_input(input_name, &input, 0, message))
+                return 1;
+            error = tokens_name != NULL && write_tokens(options, input.data, input.size, message);
+            if (!error && xref_name != NULL)
+                error = write_xref_file(options, input.data, input.size, NULL, NULL, message);
+            if (!error && variant_count != 0)
+                error = write_variants(options, input_name, input.data, input.size, -1, message);
+            close_input(&input);
+            if (error)
+                return 1;
+        }
+        return format_in_place(options, input_name, message);
+    }
+    if (open_input(input_name, &input, same, message))
+        return 1;
+    if (tokens_name != NULL && write_tokens(options, input.data, input.size, message)) {
+        close_input(&input);
+        return 1;
+    }
+    if (xref_name != NULL && (output_name == NULL || first_line != 1 || last_line != (size_t) -1 || variant_count != 0)) {
+        if (write_xref_file(options, input.data, input.size, NULL, NULL, message)) {
+            close_input(&input);
+            return 1;
+        }
+    }
+    if (variant_count != 0) {
+        output = output_name != NULL ? open_output(output_name, message) : -1;
+        if (output_name != NULL && output < 0) {
+            close_input(&input);
+            return 1;
+        }
+        error = write_variants(options, input_name, input.data, input.size, output, message);
+        close_input(&input);
+        if (output >= 0 && close_output(output, error, message))
+            error = 1;
+        return error;
+    }
+    if (output_name == NULL) {
+        close_input(&input);
+        return 0;
+    }
+    output = open_output(output_name, message);
+    if (output < 0) {
+        close_input(&input);
+        return 1;
+    }
+    if (xref_name != NULL && first_line == 1 && last_line == (size_t) -1) {
+        error = write_xref_file(options, input.data, input.size, write_file, &output, message);
+        close_input(&input);
+        return close_output(output, error, message);
+    }
+    if (daemon_socket != NULL)
+        error = format_lines(options, input.data, input.size, first_line, last_line, write_file, &output);
+    else if (first_line == 1 && last_line == (size_t) -1)
+        error = pretty6502_format_parallel(options, input.data, input.size, jobs, write_file, &output);
+    else
+        error = pretty6502_format_lines(options, input.data, input.size, first_line, last_line, write_file, &output);
+    close_input(&input);
+    return close_output(output, error, message);
+}
+
+/*
+ ** Cache of formatted files
+ **
+ ** A file shared by all the runs (mapped in memory) with a table of
+ ** 64-bit keys, each one meaning "this content with these options
+ ** is already formatted". There are keys for the content hash, and
+ ** keys for the file identity (device, inode, size, and time) so a
+ ** clean file can be skipped after only a stat().
+ **
+ ** Slots are updated with atomic operations, so several runs can
+ ** share the file. If a probe sequence is full a key is replaced.
+ */
+#define CACHE_MAGIC     0x3130304548434150ULL   /* PACHE001 */
+#define CACHE_SLOTS     65536   /* Must be a power of two */
+#define CACHE_PROBES    8
+
+unsigned long long *cache_slots;
+
+/*
+ ** Hash a block of bytes
+ */
+unsigned long long hash_bytes(void *data, size_t size, unsigned long long hash)
+{
+    unsigned char *p = data;
+    unsigned long long word;
+    
+    hash ^= size * 0x9e3779b97f4a7c15ULL;
+    while (size >= 8) {
+        memcpy(&word, p, 8);
+        hash = (hash ^ word) * 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 32;
+        p += 8;
+        size -= 8;
+    }
+    word = 0;
+    memcpy(&word, p, size);
+    hash = (hash ^ word) * 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 29;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 32;
+    return hash != 0 ? hash : 1;    /* Zero is an empty slot */
+}
+
+/*
+ ** Open the cache file
+ */
+int cache_open(char *name)
+{
+    unsigned long long magic;
+    int fd;
+    size_t size;
+    struct stat info;
+    
+    size = (CACHE_SLOTS + 1) * sizeof(unsigned long long);
+    fd = open(name, O_RDWR | O_CREAT, 0666);
+    if (fd < 0)
+        return 1;
+    if (fstat(fd, &info) != 0 || (info.st_size < (off_t) size && ftruncate(fd, size) != 0)) {
+        close(fd);
+        return 1;
+    }
+    cache_slots = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (cache_slots == MAP_FAILED) {
+        cache_slots = NULL;
+        return 1;
+    }
+    
+    /*
+     ** Slot zero has the magic number, a new file is marked
+     */
+    magic = 0;
+    __atomic_compare_exchange_n(&cache_slots[0], &magic, CACHE_MAGIC, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    if (magic != 0 && magic != CACHE_MAGIC) {
+        munmap(cache_slots, size);
+        cache_slots = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ ** Look for a key in the cache
+ */
+int cache_lookup(unsigned long long key)
+{
+    int c;
+    
+    for (c = 0; c < CACHE_PROBES; c++) {
+        if (__atomic_load_n(&cache_slots[1 + ((key + c) & (CACHE_SLOTS - 1))], __ATOMIC_RELAXED) == key)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ ** Insert a key in the cache
+ */
+void cache_insert(unsigned long long key)
+{
+    unsigned long long *slot;
+    unsigned long long empty;
+    int c;
+    
+    for (c = 0; c < CACHE_PROBES; c++) {
+        slot = &cache_slots[1 + ((key + c) & (CACHE_SLOTS - 1))];
+        empty = 0;
+        if (__atomic_compare_exchange_n(slot, &empty, key, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED) || empty == key)
+            return;
+    }
+    __atomic_store_n(&cache_slots[1 + (key & (CACHE_SLOTS - 1))], key, __ATOMIC_RELAXED);
+}
+
+/*
+ ** Key for the options (and program version), field by field so
+ ** the padding of the structure doesn't count
+ */
+unsigned long long options_key(struct pretty6502_options *options)
+{
+    int fields[11];
+    unsigned long long key;
+    
+    fields[0] = options->style;
+    fields[1] = options->processor;
+    fields[2] = options->start_mnemonic;
+    fields[3] = options->start_operand;
+    fields[4] = options->start_comment;
+    fields[5] = options->tabs;
+    fields[6] = options->align_comment;
+    fields[7] = options->nesting_space;
+    fields[8] = options->labels_own_line;
+    fields[9] = options->mnemonics_case;
+    fields[10] = options->directives_case;
+    key = hash_bytes(fields, sizeof(fields), hash_bytes(VERSION, strlen(VERSION), 0));
+    if (options->dialect != NULL)   /* Custom dialect by its content */
+        key = hash_bytes(options->dialect, options->dialect->size, key);
+    return key;
+}
+
+/*
+ ** Key for the identity of a file, zero if the file changed so
+ ** recently that another change could keep the same time
+ */
+unsigned long long stat_key(struct pretty6502_options *options, struct stat *info)
+{
+    unsigned long long identity[5];
+    
+    if (info->st_mtime >= time(NULL) - 1)
+        return 0;
+    identity[0] = info->st_dev;
+    identity[1] = info->st_ino;
+    identity[2] = info->st_size;
+    identity[3] = info->st_mtim.tv_sec;
+    identity[4] = info->st_mtim.tv_nsec;
+    return hash_bytes(identity, sizeof(identity), options_key(options) ^ 0x5354);
+}
+
+/*
+ ** Key for the content of a file
+ */
+unsigned long long content_key(struct pretty6502_options *options, char *data, size_t size)
+{
+    return hash_bytes(data, size, options_key(options) ^ 0x434f);
+}
+
+/*
+ ** Check if the cache knows the file is formatted
+ */
+int cache_clean(struct pretty6502_options *options, char *name)
+{
+    struct stat info;
+    unsigned long long key;
+    
+    if (cache_slots == NULL || stat(name, &info) != 0)
+        return 0;
+    key = stat_key(options, &info);
+    return key != 0 && cache_lookup(key);
+}
+
+/*
+ ** Record a file as formatted
+ */
+void cache_formatted(struct pretty6502_options *options, char *name, char *data, size_t size)
+{
+    struct stat info;
+    unsigned long long key;
+    
+    if (cache_slots == NULL)
+        return;
+    cache_insert(content_key(options, data, size));
+    if (stat(name, &info) == 0 && info.st_size == (off_t) size) {
+        key = stat_key(options, &info);
+        if (key != 0)
+            cache_insert(key);
+    }
+}
+
+/*
+ ** Check if the cache knows the content is formatted (also records
+ ** the file identity for the next time)
+ */
+int cache_clean_content(struct pretty6502_options *options, char *name, char *data, size_t size)
+{
+    if (cache_slots == NULL || !cache_lookup(content_key(options, data, size)))
+        return 0;
+    cache_formatted(options, name, data, size);
+    return 1;
+}
+
+/*
+ ** Comparison against the original input for check mode
+ */
+struct compare {
+    char *data;
+    size_t size;
+    size_t position;    /* Bytes already compared */
+    int different;
+};
+
+/*
+ ** Sink comparing output with input, stops at first difference
+ */
+int write_compare(void *context, char *data, size_t length)
+{
+    struct compare *compare = context;
+    size_t c;
+    
+    for (c = 0; c < length; c++) {
+        if (compare->position + c == compare->size || compare->data[compare->position + c] != data[c]) {
+            compare->position += c;
+            compare->different = 1;
+            return 1;
+        }
+    }
+    compare->position += length;
+    return 0;
+}
+
+/*
+ ** Check a file is already formatted, returns zero if it is, 2 if
+ ** it isn't (message tells the first different line), or 1 for errors
+ */
+int check_file(struct pretty6502_options *options, char *input_name, char *message)
+{
+    struct input_file input;
+    struct compare compare;
+    size_t line;
+    size_t c;
+    
+    if (cache_clean(options, input_name))
+        return 0;
+    if (open_input(input_name, &input, 0, message))
+        return 1;
+    if (cache_clean_content(options, input_name, input.data, input.size)) {
+        close_input(&input);
+        return 0;
+    }
+    compare.data = input.data;
+    compare.size = input.size;
+    compare.position = 0;
+    compare.different = 0;
+    if (format_lines(options, input.data, input.size, 1, (size_t) -1, write_compare, &compare) && !compare.different) {
+        sprintf(message, "Unable to allocate memory");
+        close_input(&input);
+        return 1;
+    }
+    if (!compare.different && compare.position == compare.size) {
+        cache_formatted(options, input_name, input.data, input.size);
+        close_input(&input);
+        return 0;
+    }
+    line = 1;
+    for (c = 0; c < compare.position; c++) {
+        if (input.data[c] == '\n')
+            line++;
+    }
+    sprintf(message, "%.200s:%lu: not formatted", input_name, (unsigned long) line);
+    close_input(&input);
+    return 2;
+}
+
+/*
+ ** Unified diff (--diff)
+ **
+ ** Each input line is compared with its formatted text as they are
+ ** produced, so there is no search for the best match: a changed line
+ ** is removed and its formatted lines (two if the label moved to its
+ ** own line) are added. The lines added by consecutive changes go
+ ** after the lines removed. Only the hunks with changes are kept.
+ */
+#define DIFF_CONTEXT    3
+#define DIFF_NO_NEWLINE "\n\\ No newline at end of file\n"
+
+struct diff_line {
+    char *text;
+    size_t length;
+};
+
+struct diff {
+    char *name;
+    struct memory_sink text;    /* Complete diff */
+    struct memory_sink hunk;    /* Lines of current hunk */
+    struct memory_sink added;   /* Lines added by the last changes */
+    size_t input_line;          /* Next line numbers */
+    size_t output_line;
+    size_t input_start;         /* Current hunk */
+    size_t output_start;
+    size_t input_count;
+    size_t output_count;
+    int in_hunk;
+    struct diff_line context[DIFF_CONTEXT * 2 + 1];     /* Unchanged lines pending */
+    int context_count;
+    int error;
+};
+
+/*
+ ** Add a line with its prefix, marking the missing line break at
+ ** end of file
+ */
+void diff_add(struct diff *diff, struct memory_sink *lines, char prefix, char *text, size_t length)
+{
+    diff->error |= write_memory(lines, &prefix, 1);
+    diff->error |= write_memory(lines, text, length);
+    if (length == 0 || text[length - 1] != '\n')
+        diff->error |= write_memory(lines, DIFF_NO_NEWLINE, sizeof(DIFF_NO_NEWLINE) - 1);
+}
+
+/*
+ ** Move the lines added to the hunk
+ */
+void diff_added(struct diff *diff)
+{
+    diff->error |= write_memory(&diff->hunk, diff->added.data, diff->added.used);
+    diff->added.used = 0;
+}
+
+/*
+ ** Add the first unchanged lines pending as context
+ */
+void diff_context(struct diff *diff, int count)
+{
+    int c;
+    
+    if (count == 0)
+        return;
+    diff_added(diff);
+    for (c = 0; c < count; c++)
+        diff_add(diff, &diff->hunk, ' ', diff->context[c].text, diff->context[c].length);
+    diff->input_count += count;
+    diff->output_count += count;
+}
+
+/*
+ ** Finish the current hunk
+ */
+void diff_hunk(struct diff *diff)
+{
+    char header[128];
+    
+    diff_added(diff);
+    if (diff->text.used == 0) {
+        diff->error |= write_memory(&diff->text, "--- ", 4);
+        diff->error |= write_memory(&diff->text, diff->name, strlen(diff->name));
+        diff->error |= write_memory(&diff->text, "\n+++ ", 5);
+        diff->error |= write_memory(&diff->text, diff->name, strlen(diff->name));
+        diff->error |= write_memory(&diff->text, "\n", 1);
+    }
+    sprintf(header, "@@ -%lu,%lu +%lu,%lu @@\n",
+            (unsigned long) (diff->input_count ? diff->input_start : diff->input_start - 1),
+            (unsigned long) diff->input_count,
+            (unsigned long) (diff->output_count ? diff->output_start : diff->output_start - 1),
+            (unsigned long) diff->output_count);
+    diff->error |= write_memory(&diff->text, header, strlen(header));
+    diff->error |= write_memory(&diff->text, diff->hunk.data, diff->hunk.used);
+    diff->hunk.used = 0;
+    diff->in_hunk = 0;
+}
+
+/*
+ ** Compare an input line with its formatted text
+ */
+int diff_line(void *context, char *input, size_t input_length, char *output, size_t output_length)
+{
+    struct diff *diff = context;
+    char *p;
+    char *next;
+    char *end;
+    size_t lines;
+    
+    if (input_length == output_length && memcmp(input, output, input_length) == 0) {
+        if (diff->in_hunk && diff->context_count == DIFF_CONTEXT * 2) {     /* Too far to join next change */
+            diff_context(diff, DIFF_CONTEXT);
+            diff_hunk(diff);
+            memmove(diff->context, diff->context + DIFF_CONTEXT + 1, (DIFF_CONTEXT - 1) * sizeof(struct diff_line));
+            diff->context_count = DIFF_CONTEXT - 1;
+        } else if (!diff->in_hunk && diff->context_count == DIFF_CONTEXT) {
+            memmove(diff->context, diff->context + 1, (DIFF_CONTEXT - 1) * sizeof(struct diff_line));
+            diff->context_count--;
+        }
+        diff->context[diff->context_count].text = input;
+        diff->context[diff->context_count].length = input_length;
+        diff->context_count++;
+        diff->input_line++;
+        diff->output_line++;
+        return 0;
+    }
+    if (!diff->in_hunk) {
+        diff->in_hunk = 1;
+        diff->input_start = diff->input_line - diff->context_count;
+        diff->output_start = diff->output_line - diff->context_count;
+        diff->input_count = 0;
+        diff->output_count = 0;
+    }
+    diff_context(diff, diff->context_count);
+    diff->context_count = 0;
+    if (input_length != 0) {    /* Empty file has no line */
+        diff_add(diff, &diff->hunk, '-', input, input_length);
+        diff->input_count++;
+        diff->input_line++;
+    }
+    lines = 0;
+    end = output + output_length;
+    for (p = output; p < end; p = next) {
+        next = memchr(p, '\n', end - p);
+        next = next != NULL ? next + 1 : end;
+        diff_add(diff, &diff->added, '+', p, next - p);
+        lines++;
+    }
+    diff->output_count += lines;
+    diff->output_line += lines;
+    return diff->error;
+}
+
+/*
+ ** Make the unified diff of a file against its formatted text,
+ ** returns zero if it is formatted, 2 if it isn't (text gets the
+ ** diff, free it with free()), or 1 for errors
+ */
+int diff_file(struct pretty6502_options *options, char *input_name, char **text, size_t *length, char *message)
+{
+    struct input_file input;
+    struct diff diff;
+    int error;
+    
+    *text = NULL;
+    *length = 0;
+    if (cache_clean(options, input_name))
+        return 0;
+    if (open_input(input_name, &input, 0, message))
+        return 1;
+    if (cache_clean_content(options, input_name, input.data, input.size)) {
+        close_input(&input);
+        return 0;
+    }
+    memset(&diff, 0, sizeof(diff));
+    diff.name = input_name;
+    diff.input_line = 1;
+    diff.output_line = 1;
+    error = pretty6502_format_each(options, input.data, input.size, diff_line, &diff);
+    if (!error && diff.in_hunk) {
+        diff_context(&diff, diff.context_count < DIFF_CONTEXT ? diff.context_count : DIFF_CONTEXT);
+        diff_hunk(&diff);
+    }
+    free(diff.hunk.data);
+    free(diff.added.data);
+    if (error || diff.error) {
+        sprintf(message, "Unable to allocate memory");
+        free(diff.text.data);
+        close_input(&input);
+        return 1;
+    }
+    if (diff.text.used == 0) {
+        cache_formatted(options, input_name, input.data, input.size);
+        close_input(&input);
+        return 0;
+    }
+    close_input(&input);
+    *text = diff.text.data;
+    *length = diff.text.used;
+    return 2;
+}
+
+/*
+ ** Replace a file atomically
+ **
+ ** The data goes to a temporary file in the same directory that is
+ ** synced and then renamed over the file, so a crash leaves either
+ ** the old or the new content. Returns zero if successful.
+ */
+int replace_file(char *name, char *data, size_t length, char *message)
+{
+    struct stat info;
+    char *target;
+    char *temporary;
+    char *p;
+    int fd;
+    int error;
+    
+    target = realpath(name, NULL);  /* Replace the file, not a link to it */
+    if (target == NULL)
+        target = strdup(name);
+    temporary = target != NULL ? malloc(strlen(target) + 20) : NULL;
+    if (temporary == NULL) {
+        free(target);
+        sprintf(message, "Unable to allocate memory");
+        return 1;
+    }
+    sprintf(temporary, "%s.pretty6502.XXXXXX", target);
+    fd = mkstemp(temporary);
+    if (fd < 0) {
+        sprintf(message, "Unable to open output file: %.200s", temporary);
+        free(temporary);
+        free(target);
+        return 1;
+    }
+    error = 0;
+    if (stat(target, &info) == 0) {   /* Keep owner (if allowed) and mode */
+        if (fchown(fd, info.st_uid, info.st_gid) != 0 && errno != EPERM)
+            error = 1;
+        if (fchmod(fd, info.st_mode & 07777) != 0)
+            error = 1;
+    }
+    if (write_file(&fd, data, length) != 0 || fsync(fd) != 0)
+        error = 1;
+    if (close(fd) != 0)
+        error = 1;
+    if (!error && rename(temporary, target) != 0)
+        error = 1;
+    if (error) {
+        unlink(temporary);
+        sprintf(message, "Something went wrong writing the output file");
+    } else {
+        p = strrchr(target, '/');   /* Make the rename durable */
+        if (p != NULL) {
+            *p = '\0';
+            fd = open(p == target ? "/" : target, O_RDONLY);
+        } else {
+            fd = open(".", O_RDONLY);
+        }
+        if (fd >= 0) {
+            fsync(fd);
+            close(fd);
+        }
+    }
+    free(temporary);
+    free(target);
+    return error;
+}
+
+/*
+ ** Format a file in place, it isn't written if already formatted
+ */
+int format_in_place(struct pretty6502_options *options, char *name, char *message)
+{
+    struct input_file input;
+    struct memory_sink memory;
+    char *result;
+    size_t length;
+    int error;
+    
+    if (cache_clean(options, name))
+        return 0;
+    if (open_input(name, &input, 0, message))
+        return 1;
+    if (cache_clean_content(options, name, input.data, input.size)) {
+        close_input(&input);
+        return 0;
+    }
+    memory.size = input.size + input.size / 4 + 256;
+    memory.used = 0;
+    memory.data = malloc(memory.size);
+    if (memory.data == NULL) {
+        sprintf(message, "Unable to allocate memory");
+        close_input(&input);
+        return 1;
+    }
+    if (format_lines(options, input.data, input.size, 1, (size_t) -1, write_memory, &memory)) {
+        sprintf(message, "Unable to format file: %.200s", name);
+        free(memory.data);
+        close_input(&input);
+        return 1;
+    }
+    result = memory.data;
+    length = memory.used;
+    if (length == input.size && memcmp(result, input.data, length) == 0) {
+        cache_formatted(options, name, input.data, input.size);
+        free(result);
+        close_input(&input);
+        return 0;
+    }
+    close_input(&input);
+    error = replace_file(name, result, length, message);
+    if (!error)
+        cache_formatted(options, name, result, length);
+    free(result);
+    return error;
+}
+
+/*
+ ** Streaming mode
+ **
+ ** Lines are read through a fixed buffer and formatted as soon as
+ ** they are complete, so memory use doesn't depend on file size.
+ ** The buffer only grows when a single line doesn't fit in it.
+ */
+#define STREAM_BUFFER   65536
+
+/*
+ ** Format a stream, returns zero if successful or else fills message
+ */
+int stream_file(struct pretty6502_options *options, int input, char *output_name, char *message)
+{
+    struct format_state state;
+    struct output output;
+    char *buffer;
+    char *new_buffer;
+    char *p;
+    size_t size;
+    size_t used;
+    size_t start;
+    size_t scan;
+    ssize_t length;
+    size_t line;
+    unsigned long long read_start;
+    int fd;
+    
+    pthread_once(&keyword_index_once, build_indexes);
+    fd = open_output(output_name, message);
+    if (fd < 0)
+        return 1;
+    output.sink = write_file;
+    output.context = &fd;
+    output.used = 0;
+    output.error = 0;
+    output.discard = 0;
+    output.buffer = malloc(OUTPUT_BUFFER);
+    size = STREAM_BUFFER;
+    buffer = malloc(size + 1);
+    if (output.buffer == NULL || buffer == NULL || start_state(&state, options)) {
+        sprintf(message, "Unable to allocate memory");
+        free(output.buffer);
+        free(buffer);
+        close_output(fd, 0, message);
+        return 1;
+    }
+    used = 0;
+    line = 1;
+    while (1) {
+        if (used == size) {     /* Line doesn't fit, grow buffer */
+            new_buffer = realloc(buffer, size * 2 + 1);
+            if (new_buffer == NULL) {
+                sprintf(message, "Unable to allocate memory");
+                break;
+            }
+            buffer = new_buffer;
+            size *= 2;
+        }
+        output_flush(&output);  /* Complete lines go out before waiting */
+        read_start = stats_mode ? clock_nanoseconds() : 0;
+        if (line > last_line)   /* Range complete */
+            length = 0;
+        else
+            length = read(input, buffer + used, size - used);
+        if (stats_mode) {
+            stats_add(&stats_read, clock_nanoseconds() - read_start);
+            if (length > 0)
+                stats_add(&stats_bytes, length);
+        }
+        if (length < 0) {
+            if (errno == EINTR)
+                continue;
+            sprintf(message, "Something went wrong reading the input file");
+            break;
+        }
+        if (length == 0) {
+        
+            /*
+             ** Last line without line break (or empty input)
+             */
+            used = prepare_line(buffer, buffer + used, 0);
+            if (line <= last_line && line >= first_line && (used != 0 || line == 1))
+                state.format_line(&state, buffer, buffer + used, &output);
+            if (stats_mode) {
+                stats_add(&stats_files, 1);
+                stats_add(&stats_lines, line - (used == 0));
+            }
+            output_flush(&output);
+            free(output.buffer);
+            free(buffer);
+            return close_output(fd, output.error, message);
+        }
+        scan = used;
+        used += length;
+        start = 0;
+        while (line <= last_line && (p = memchr(buffer + scan, '\n', used - scan)) != NULL) {
+            output.discard = line < first_line;
+            STAT_PRESCAN(output.discard);
+            state.format_line(&state, buffer + start, buffer + start + prepare_line(buffer + start, p, 1), &output);
+            STAT_PRESCAN(0);
+            output.discard = 0;
+            start = p - buffer + 1;
+            scan = start;
+            line++;
+        }
+        memmove(buffer, buffer + start, used - start);
+        used -= start;
+    }
+    free(output.buffer);
+    free(buffer);
+    close_output(fd, 0, message);
+    return 1;
+}
+
+/*
+ ** Batch mode
+ **
+ ** Every file is formatted in place. The tasks are sorted by size
+ ** so the biggest files start first, and the worker threads take
+ ** them from the shared queue while the memory in flight stays
+ ** under the limit. Results are reported in the input order.
+ **
+ ** With --follow the included files are added to the queue as they
+ ** are found, so the workers start formatting them while the file
+ ** including them is still processed. Each file is processed once
+ ** even if it is reached through several paths or links.
+ */
+#define BATCH_MEMORY    256     /* Default memory limit in megabytes */
+
+struct task {
+    char *name;
+    long long size;
+    int result;
+    int done;
+    char message[256];
+    char *diff;         /* Unified diff (--diff) */
+    size_t diff_length;
+};
+
+struct task *tasks;
+int task_count;
+int task_size;
+int *task_queue;            /* Tasks sorted by size (biggest first) */
+int task_queue_size;
+int task_next;              /* Next task to take from queue */
+int task_report;            /* Next task to report */
+int task_busy;              /* Tasks being processed */
+long long memory_in_flight;
+long long memory_limit;
+int batch_errors;
+int batch_unformatted;
+pthread_mutex_t task_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t task_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ ** Files already in the batch when following includes, by their
+ ** real path (the inode changes when a file is replaced)
+ */
+int follow_includes;
+char **seen_files;
+int seen_count;
+int seen_size;     /* Power of two */
+
+/*
+ ** Extensions of files formatted when walking a directory
+ */
+char *batch_extensions[] = {
+    ".asm", ".s", ".a", ".a65", ".a99", ".inc", ".z80", NULL,
+};
+
+/*
+ ** Add a task
+ */
+void add_task(char *name, long long size)
+{
+    if (task_count == task_size) {
+        task_size = task_size ? task_size * 2 : 256;
+        tasks = realloc(tasks, task_size * sizeof(struct task));
+        if (tasks == NULL) {
+            fprintf(stderr, "Unable to allocate memory\n");
+            exit(1);
+        }
+    }
+    if (task_queue != NULL && task_count == task_queue_size) {   /* Queue grows while following */
+        task_queue_size *= 2;
+        task_queue = realloc(task_queue, task_queue_size * sizeof(int));
+        if (task_queue == NULL) {
+            fprintf(stderr, "Unable to allocate memory\n");
+            exit(1);
+        }
+    }
+    memset(&tasks[task_count], 0, sizeof(struct task));
+    tasks[task_count].name = strdup(name);
+    tasks[task_count].size = size;
+    if (task_queue != NULL)
+        task_queue[task_count] = task_count;
+    task_count++;
+}
+
+/*
+ ** Hash of a path for the files seen
+ */
+unsigned int hash_path(char *path)
+{
+    unsigned int hash;
+    
+    hash = 2166136261u;
+    while (*path)
+        hash = (hash ^ (unsigned char) *path++) * 16777619u;
+    return hash;
+}
+
+/*
+ ** Remember a file, returns 1 if it was already seen
+ */
+int seen_file(char *name)
+{
+    char **old_files;
+    char *path;
+    int old_size;
+    int c;
+    int d;
+    
+    if (seen_count * 2 >= seen_size) {
+        old_files = seen_files;
+        old_size = seen_size;
+        seen_size = seen_size ? seen_size * 2 : 256;
+        seen_files = calloc(seen_size, sizeof(char *));
+        if (seen_files == NULL) {
+            fprintf(stderr, "Unable to allocate memory\n");
+            exit(1);
+        }
+        for (c = 0; c < old_size; c++) {
+            if (old_files[c] != NULL) {
+                d = hash_path(old_files[c]) & (seen_size - 1);
+                while (seen_files[d] != NULL)
+                    d = (d + 1) & (seen_size - 1);
+                seen_files[d] = old_files[c];
+            }
+        }
+        free(old_files);
+    }
+    path = realpath(name, NULL);
+    if (path == NULL)
+        path = strdup(name);
+    if (path == NULL) {
+        fprintf(stderr, "Unable to allocate memory\n");
+        exit(1);
+    }
+    d = hash_path(path) & (seen_size - 1);
+    while (seen_files[d] != NULL) {
+        if (strcmp(seen_files[d], path) == 0) {
+            free(path);
+            return 1;
+        }
+        d = (d + 1) & (seen_size - 1);
+    }
+    seen_files[d] = path;
+    seen_count++;
+    return 0;
+}
+
+/*
+ ** Check if a file name has an assembler extension
+ */
+int batch_extension(char *name)
+{
+    char *p;
+    int c;
+    
+    p = strrchr(name, '.');
+    if (p == NULL)
+        return 0;
+    for (c = 0; batch_extensions[c] != NULL; c++) {
+        if (strlen(p) == strlen(batch_extensions[c]) && memcmpcase(p, batch_extensions[c], strlen(p)) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ ** Compare two names for sorting
+ */
+int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char **) a, *(char **) b);
+}
+
+int add_path(char *name, int explicit);
+
+/*
+ ** Walk a directory, names are sorted so the order is always the same
+ */
+int walk_directory(char *name)
+{
+    DIR *dir;
+    struct dirent *entry;
+    char **names;
+    int count;
+    int size;
+    int c;
+    int result;
+    char *path;
+    
+    dir = opendir(name);
+    if (dir == NULL) {
+        fprintf(stderr, "Unable to open directory: %s\n", name);
+        return 1;
+    }
+    names = NULL;
+    count = 0;
+    size = 0;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.')    /* Ignore hidden files, . and .. */
+            continue;
+        if (count == size) {
+            size = size ? size * 2 : 64;
+            names = realloc(names, size * sizeof(char *));
+            if (names == NULL) {
+                fprintf(stderr, "Unable to allocate memory\n");
+                exit(1);
+            }
+        }
+        names[count++] = strdup(entry->d_name);
+    }
+    closedir(dir);
+    qsort(names, count, sizeof(char *), compare_names);
+    result = 0;
+    for (c = 0; c < count; c++) {
+        path = malloc(strlen(name) + strlen(names[c]) + 2);
+        if (path == NULL) {
+            fprintf(stderr, "Unable to allocate memory\n");
+            exit(1);
+        }
+        sprintf(path, "%s/%s", name, names[c]);
+        result |= add_path(path, 0);
+        free(path);
+        free(names[c]);
+    }
+    free(names);
+    return result;
+}
+
+/*
+ ** Add a file or a directory to the batch
+ */
+int add_path(char *name, int explicit)
+{
+    struct stat info;
+    
+    if (stat(name, &info) != 0) {
+        fprintf(stderr, "Unable to open input file: %s\n", name);
+        return 1;
+    }
+    if (S_ISDIR(info.st_mode))
+        return walk_directory(name);
+    if (S_ISREG(info.st_mode) && (explicit || batch_extension(name))) {
+        if (follow_includes && seen_file(name))
+            return 0;
+        add_task(name, info.st_size);
+    }
+    return 0;
+}
+
+/*
+ ** Read a list of names separated by NUL characters
+ */
+int read_list(char *name)
+{
+    FILE *input;
+    char *buffer;
+    int size;
+    int length;
+    int c;
+    int result;
+    
+    if (strcmp(name, "-") == 0) {
+        input = stdin;
+    } else {
+        input = fopen(name, "rb");
+        if (input == NULL) {
+            fprintf(stderr, "Unable to open list file: %s\n", name);
+            return 1;
+        }
+    }
+    size = 4096;
+    length = 0;
+    buffer = malloc(size);
+    while (buffer != NULL) {
+        length += fread(buffer + length, 1, size - length - 1, input);
+        if (length < size - 1)
+            break;
+        size *= 2;
+        buffer = realloc(buffer, size);
+    }
+    if (input != stdin)
+        fclose(input);
+    if (buffer == NULL) {
+        fprintf(stderr, "Unable to allocate memory\n");
+        exit(1);
+    }
+    buffer[length] = '\0';
+    result = 0;
+    c = 0;
+    while (c < length) {
+        if (buffer[c] != '\0')
+            result |= add_path(buffer + c, 1);
+        c += strlen(buffer + c) + 1;
+    }
+    free(buffer);
+    return result;
+}
+
+/*
+ ** Compare two tasks for sorting, biggest first
+ */
+int compare_tasks(const void *a, const void *b)
+{
+    int task1 = *(int *) a;
+    int task2 = *(int *) b;
+    
+    if (tasks[task1].size != tasks[task2].size)
+        return tasks[task1].size < tasks[task2].size ? 1 : -1;
+    return task1 < task2 ? -1 : 1;
+}
+
+/*
+ ** Included file found while following, the name is relative to
+ ** the directory of the file including it or else to the current
+ ** directory
+ */
+void follow_include(void *context, char *name, size_t length)
+{
+    char *including = context;
+    struct stat info;
+    char path[4096];
+    char *p;
+    size_t directory;
+    
+    if (length == 0 || memchr(name, '\0', length) != NULL)
+        return;
+    p = strrchr(including, '/');
+    directory = (p != NULL && name[0] != '/') ? p - including + 1 : 0;
+    if (directory + length >= sizeof(path))
+        return;
+    memcpy(path, including, directory);
+    memcpy(path + directory, name, length);
+    path[directory + length] = '\0';
+    if (directory != 0 && stat(path, &info) != 0)
+        memmove(path, path + directory, length + 1);
+    if (stat(path, &info) != 0 || !S_ISREG(info.st_mode)) {
+        pthread_mutex_lock(&task_mutex);
+        fprintf(stderr, "Warning: unable to find %s included by %s\n", path, including);
+        pthread_mutex_unlock(&task_mutex);
+        return;
+    }
+    pthread_mutex_lock(&task_mutex);
+    if (!seen_file(path)) {
+        add_task(path, info.st_size);
+        pthread_cond_broadcast(&task_cond);
+    }
+    pthread_mutex_unlock(&task_mutex);
+}
+
+/*
+ ** Add the files included by a file to the batch
+ */
+void follow_file(struct pretty6502_options *options, char *name)
+{
+    struct input_file input;
+    char message[256];
+    
+    if (open_input(name, &input, 0, message))
+        return;     /* Reported when formatting */
+    pretty6502_includes(options, input.data, input.size, follow_include, name);
+    close_input(&input);
+}
+
+/*
+ ** Worker thread for batch mode
+ */
+void *batch_worker(void *arg)
+{
+    struct pretty6502_options *options = arg;
+    struct task *task;
+    char message[256];
+    char *name;
+    char *diff;
+    size_t diff_length;
+    long long size;
+    unsigned long long start;
+    int result;
+    int index;
+    
+    pthread_mutex_lock(&task_mutex);
+    while (1) {
+        while (task_next == task_count && task_busy > 0)  /* Can find more files */
+            pthread_cond_wait(&task_cond, &task_mutex);
+        if (task_next == task_count)
+            break;
+        index = task_queue[task_next++];
+        name = tasks[index].name;
+        size = tasks[index].size;
+        while (memory_in_flight > 0 && memory_in_flight + size > memory_limit)
+            pthread_cond_wait(&task_cond, &task_mutex);
+        memory_in_flight += size;
+        task_busy++;
+        pthread_mutex_unlock(&task_mutex);
+        
+        message[0] = '\0';
+        start = stats_mode ? clock_nanoseconds() : 0;
+        diff = NULL;
+        diff_length = 0;
+        if (follow_includes)
+            follow_file(options, name);
+        if (diff_mode)
+            result = diff_file(options, name, &diff, &diff_length, message);
+        else if (check_mode)
+            result = check_file(options, name, message);
+        else
+            result = format_in_place(options, name, message);
+        if (stats_mode)
+            stats_add(&stats_busy, clock_nanoseconds() - start);
+        
+        pthread_mutex_lock(&task_mutex);
+        memory_in_flight -= size;
+        task_busy--;
+        task = &tasks[index];   /* The tasks can move while following */
+        task->result = result;
+        strcpy(task->message, message);
+        task->diff = diff;
+        task->diff_length = diff_length;
+        task->done = 1;
+        while (task_report < task_count && tasks[task_report].done) {
+            if (!check_mode)
+                fprintf(stderr, "Processing %s...\n", tasks[task_report].name);
+            if (tasks[task_report].diff != NULL) {
+                fwrite(tasks[task_report].diff, 1, tasks[task_report].diff_length, stdout);
+                free(tasks[task_report].diff);
+            } else if (tasks[task_report].result) {
+                fprintf(stderr, "%s\n", tasks[task_report].message);
+            }
+            if (tasks[task_report].result) {
+                if (tasks[task_report].result == 2)
+                    batch_unformatted++;
+                else
+                    batch_errors++;
+            }
+            task_report++;
+        }
+        pthread_cond_broadcast(&task_cond);
+    }
+    pthread_mutex_unlock(&task_mutex);
+    return NULL;
+}
+
+/*
+ ** Format every file given in the batch
+ */
+int batch_mode(struct pretty6502_options *options, int count, char *names[], char *list, int jobs, int memory)
+{
+    pthread_t *threads;
+    int result;
+    int c;
+    
+    result = 0;
+    if (list != NULL)
+        result |= read_list(list);
+    for (c = 0; c < count; c++)
+        result |= add_path(names[c], 1);
+    if (task_count == 0)
+        return result;
+    task_queue_size = task_size;
+    task_queue = malloc(task_queue_size * sizeof(int));
+    if (task_queue == NULL) {
+        fprintf(stderr, "Unable to allocate memory\n");
+        exit(1);
+    }
+    for (c = 0; c < task_count; c++)
+        task_queue[c] = c;
+    qsort(task_queue, task_count, sizeof(int), compare_tasks);
+    memory_limit = (long long) memory * 1024 * 1024;
+    if (jobs <= 0)
+        jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (jobs <= 0)
+        jobs = 1;
+    if (jobs > task_count && !follow_includes)
+        jobs = task_count;
+    threads = malloc(jobs * sizeof(pthread_t));
+    if (threads == NULL) {
+        fprintf(stderr, "Unable to allocate memory\n");
+        exit(1);
+    }
+    for (c = 0; c < jobs; c++) {
+        if (pthread_create(&threads[c], NULL, batch_worker, options) != 0) {
+            fprintf(stderr, "Unable to create thread\n");
+            exit(1);
+        }
+    }
+    for (c = 0; c < jobs; c++)
+        pthread_join(threads[c], NULL);
+    free(threads);
+    free(task_queue);
+    for (c = 0; c < task_count; c++)
+        free(tasks[c].name);
+    free(tasks);
+    for (c = 0; c < seen_size; c++)
+        free(seen_files[c]);
+    free(seen_files);
+    if (batch_errors)
+        result = 1;
+    else if (batch_unformatted && result == 0)
+        result = 2;
+    return result;
+}
+
+/*
+ ** Watch mode
+ **
+ ** Directories are watched with inotify, the files named in the
+ ** command line through their directory (editors often save into a
+ ** new file renamed over the old one). The files changed are
+ ** collected until WATCH_QUIET milliseconds pass without events,
+ ** and then each one is formatted in place once. The process stays
+ ** running, so the tables and the cache are ready for each burst.
+ **
+ ** Replacing a file brings its own events, they are ignored because
+ ** the file keeps the identity (inode, size and time) left by the
+ ** formatting.
+ */
+#define WATCH_QUIET     50      /* Milliseconds without events to end a burst */
+#define WATCH_LONGEST   1000    /* Milliseconds before ending a long burst */
+
+struct watch_file {
+    char *name;
+    int explicit;       /* Named in the command line */
+    int pending;        /* Changed in this burst */
+    int own;            /* The identity is the one after formatting */
+    struct stat info;
+};
+
+struct watch_dir {
+    char *name;         /* Real path, NULL if not watched */
+    int all;            /* All the files with assembler extension */
+    int root;           /* Named in the command line */
+};
+
+int watch_fd;
+struct watch_dir *watch_dirs;   /* By watch descriptor */
+int watch_dirs_size;
+struct watch_file *watch_files;
+int watch_count;
+int watch_size;                 /* Power of two */
+char **watch_pending;           /* Names of the files changed */
+int watch_pending_count;
+int watch_pending_size;
+
+/*
+ ** Find a file watched, adding it if create is set
+ */
+struct watch_file *watch_file(char *name, int create)
+{
+    struct watch_file *old_files;
+    int old_size;
+    int c;
+    int d;
+    
+    if (create && watch_count * 2 >= watch_size) {
+        old_files = watch_files;
+        old_size = watch_size;
+        watch_size = watch_size ? watch_size * 2 : 256;
+        watch_files = calloc(watch_size, sizeof(struct watch_file));
+        if (watch_files == NULL) {
+            fprintf(stderr, "Unable to allocate memory\n");
+            exit(1);
+        }
+        for (c = 0; c < old_size; c++) {
+            if (old_files[c].name != NULL) {
+                d = hash_path(old_files[c].name) & (watch_size - 1);
+                while (watch_files[d].name != NULL)
+                    d = (d + 1) & (watch_size - 1);
+                watch_files[d] = old_files[c];
+            }
+        }
+        free(old_files);
+    }
+    if (watch_size == 0)
+        return NULL;
+    d = hash_path(name) & (watch_size - 1);
+    while (watch_files[d].name != NULL) {
+        if (strcmp(watch_files[d].name, name) == 0)
+            return &watch_files[d];
+        d = (d + 1) & (watch_size - 1);
+    }
+    if (!create)
+        return NULL;
+    watch_files[d].name = strdup(name);
+    if (watch_files[d].name == NULL) {
+        fprintf(stderr, "Unable to allocate memory\n");
+        exit(1);
+    }
+    watch_count++;
+    return &watch_files[d];
+}
+
+/*
+ ** Mark a file as changed
+ */
+void watch_changed(char *name)
+{
+    struct watch_file *file;
+    
+    file = watch_file(name, 1);
+    if (file->pending)
+        return;
+    if (watch_pending_count == watch_pending_size) {
+        watch_pending_size = watch_pending_size ? watch_pending_size * 2 : 64;
+        watch_pending = realloc(watch_pending, watch_pending_size * sizeof(char *));
+        if (watch_pending == NULL) {
+            fprintf(stderr, "Unable to allocate memory\n");
+            exit(1);
+        }
+    }
+    file->pending = 1;
+    watch_pending[watch_pending_count++] = file->name;
+}
+
+/*
+ ** Join a directory and a name
+ */
+char *watch_path(char *directory, char *name)
+{
+    char *path;
+    
+    path = malloc(strlen(directory) + strlen(name) + 2);
+    if (path == NULL) {
+        fprintf(stderr, "Unable to allocate memory\n");
+        exit(1);
+    }
+    sprintf(path, "%s/%s", directory, name);
+    return path;
+}
+
+/*
+ ** Watch a directory, with all set also its files and subdirectories
+ ** (links aren't followed), marking its files as changed if scan is
+ ** set. Returns the watch descriptor or -1 on error.
+ */
+int watch_directory(char *name, int all, int scan)
+{
+    struct watch_dir *dir;
+    struct dirent *entry;
+    struct stat info;
+    DIR *handle;
+    char *path;
+    char *directory;
+    int wd;
+    int c;
+    
+    path = realpath(name, NULL);
+    if (path == NULL) {
+        fprintf(stderr, "Unable to open directory: %s\n", name);
+        return -1;
+    }
+    wd = inotify_add_watch(watch_fd, path, IN_CLOSE_WRITE | IN_MOVED_TO | (all ? IN_CREATE : 0) | IN_ONLYDIR | IN_MASK_ADD);
+    if (wd < 0) {
+        if (errno == ENOSPC)
+            fprintf(stderr, "Unable to watch directory: %s (too many, see fs.inotify.max_user_watches)\n", path);
+        else
+            fprintf(stderr, "Unable to watch directory: %s\n", path);
+        free(path);
+        return -1;
+    }
+    if (wd >= watch_dirs_size) {
+        c = watch_dirs_size;
+        watch_dirs_size = wd * 2 + 16;
+        watch_dirs = realloc(watch_dirs, watch_dirs_size * sizeof(struct watch_dir));
+        if (watch_dirs == NULL) {
+            fprintf(stderr, "Unable to allocate memory\n");
+            exit(1);
+        }
+        memset(&watch_dirs[c], 0, (watch_dirs_size - c) * sizeof(struct watch_dir));
+    }
+    dir = &watch_dirs[wd];
+    if (dir->name == NULL) {
+        dir->name = path;
+        dir->all = 0;
+        dir->root = 0;
+    } else {
+        free(path);
+        if (dir->all && !scan)  /* Already walked */
+            return wd;
+    }
+    if (!all)
+        return wd;
+    dir->all = 1;
+    directory = dir->name;  /* The array can move while walking */
+    handle = opendir(directory);
+    if (handle == NULL)
+        return wd;
+    while ((entry = readdir(handle)) != NULL) {
+        if (entry->d_name[0] == '.')    /* Ignore hidden files, . and .. */
+            continue;
+        path = watch_path(directory, entry->d_name);
+        if (lstat(path, &info) == 0) {
+            if (S_ISDIR(info.st_mode))
+                watch_directory(path, 1, scan);
+            else if (scan && S_ISREG(info.st_mode) && batch_extension(path))
+                watch_changed(path);
+        }
+        free(path);
+    }
+    closedir(handle);
+    return wd;
+}
+
+/*
+ ** Watch a file or a directory of the command line
+ */
+int watch_add(char *name)
+{
+    struct stat info;
+    char *directory;
+    char *base;
+    char *path;
+    int wd;
+    
+    if (stat(name, &info) != 0) {
+        fprintf(stderr, "Unable to open input file: %s\n", name);
+        return 1;
+    }
+    if (S_ISDIR(info.st_mode)) {
+        wd = watch_directory(name, 1, 0);
+        if (wd < 0)
+            return 1;
+        watch_dirs[wd].root = 1;
+        return 0;
+    }
+    if (!S_ISREG(info.st_mode)) {
+        fprintf(stderr, "Unable to watch file: %s\n", name);
+        return 1;
+    }
+    directory = strdup(name);
+    if (directory == NULL) {
+        fprintf(stderr, "Unable to allocate memory\n");
         exit(1);
     }
-    fprintf(stderr, "Processing %s...\n", argv[c]);
-    fseek(input, 0, SEEK_END);
-    allocation = ftell(input);
-    data = malloc(allocation + sizeof(char));
-    if (data == NULL) {
-        fprintf(stderr, "Unable to allocate memory\n");
-        fclose(input);
-        exit(1);
+    base = strrchr(directory, '/');
+    if (base != NULL) {
+        *base++ = '\0';
+        wd = watch_directory(base == directory + 1 ? "/" : directory, 0, 0);
+    } else {
+        base = directory;
+        wd = watch_directory(".", 0, 0);
+    }
+    if (wd >= 0) {
+        path = watch_path(watch_dirs[wd].name, base);
+        watch_file(path, 1)->explicit = 1;
+        free(path);
+    }
+    free(directory);
+    return wd < 0;
+}
+
+/*
+ ** Process an event
+ */
+void watch_event(struct inotify_event *event)
+{
+    struct watch_dir *dir;
+    struct watch_file *file;
+    char *path;
+    int c;
+    
+    if (event->mask & IN_Q_OVERFLOW) {  /* Events lost, check everything */
+        for (c = 0; c < watch_dirs_size; c++) {
+            if (watch_dirs[c].name != NULL && watch_dirs[c].root)
+                watch_directory(watch_dirs[c].name, 1, 1);
+        }
+        for (c = 0; c < watch_size; c++) {
+            if (watch_files[c].name != NULL && watch_files[c].explicit)
+                watch_changed(watch_files[c].name);
+        }
+        return;
+    }
+    if (event->wd < 0 || event->wd >= watch_dirs_size || watch_dirs[event->wd].name == NULL)
+        return;
+    dir = &watch_dirs[event->wd];
+    if (event->mask & IN_IGNORED) {     /* Directory removed */
+        free(dir->name);
+        dir->name = NULL;
+        return;
+    }
+    if (event->len == 0 || event->name[0] == '\0')
+        return;
+    path = watch_path(dir->name, event->name);
+    if (event->mask & IN_ISDIR) {
+        if (dir->all && event->name[0] != '.' && (event->mask & (IN_CREATE | IN_MOVED_TO)))
+            watch_directory(path, 1, 1);    /* Can have files already */
+    } else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+        file = watch_file(path, 0);
+        if ((file != NULL && file->explicit) || (dir->all && event->name[0] != '.' && batch_extension(path)))
+            watch_changed(path);
+    }
+    free(path);
+}
+
+/*
+ ** Check if a file has the same identity
+ */
+int same_identity(struct stat *info1, struct stat *info2)
+{
+    return info1->st_dev == info2->st_dev && info1->st_ino == info2->st_ino && info1->st_size == info2->st_size
+    && info1->st_mtim.tv_sec == info2->st_mtim.tv_sec && info1->st_mtim.tv_nsec == info2->st_mtim.tv_nsec;
+}
+
+/*
+ ** Format the files changed in a burst
+ */
+void watch_burst(struct pretty6502_options *options)
+{
+    struct watch_file *file;
+    struct stat info;
+    char message[256];
+    int c;
+    
+    for (c = 0; c < watch_pending_count; c++) {
+        file = watch_file(watch_pending[c], 0);
+        file->pending = 0;
+        if (stat(file->name, &info) != 0 || !S_ISREG(info.st_mode))
+            continue;
+        if (file->own && same_identity(&info, &file->info))     /* Our own write */
+            continue;
+        message[0] = '\0';
+        file->own = 0;
+        if (format_in_place(options, file->name, message)) {
+            fprintf(stderr, "%s: %s\n", file->name, message);
+            continue;
+        }
+        if (stat(file->name, &file->info) != 0)
+            continue;
+        file->own = 1;
+        if (!same_identity(&info, &file->info))
+            fprintf(stderr, "Formatted %s\n", file->name);
+    }
+    watch_pending_count = 0;
+}
+
+/*
+ ** Watch files and directories, formatting the files changed
+ */
+int watch_mode(struct pretty6502_options *options, int count, char *names[])
+{
+    static char buffer[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *event;
+    struct pollfd wait;
+    unsigned long long start;
+    ssize_t length;
+    char *p;
+    int result;
+    int c;
+    
+    watch_fd = inotify_init1(IN_CLOEXEC);
+    if (watch_fd < 0) {
+        fprintf(stderr, "Unable to use inotify\n");
+        return 1;
+    }
+    result = 0;
+    for (c = 0; c < count; c++)
+        result |= watch_add(names[c]);
+    if (result)
+        return 1;
+    fprintf(stderr, "Watching for changes...\n");
+    start = 0;
+    while (1) {
+        wait.fd = watch_fd;
+        wait.events = POLLIN;
+        c = poll(&wait, 1, watch_pending_count != 0 ? WATCH_QUIET : -1);
+        if (c < 0 && errno == EINTR)
+            continue;
+        if (c < 0) {
+            fprintf(stderr, "Unable to wait for events\n");
+            return 1;
+        }
+        if (c > 0) {
+            length = read(watch_fd, buffer, sizeof(buffer));
+            if (length < 0 && errno == EINTR)
+                continue;
+            if (length <= 0) {
+                fprintf(stderr, "Unable to read events\n");
+                return 1;
+            }
+            if (watch_pending_count == 0)
+                start = clock_nanoseconds();
+            for (p = buffer; p < buffer + length; p += sizeof(struct inotify_event) + event->len) {
+                event = (struct inotify_event *) p;
+                watch_event(event);
+            }
+            if (watch_pending_count == 0 || clock_nanoseconds() - start < WATCH_LONGEST * 1000000ULL)
+                continue;
+        }
+        watch_burst(options);
+    }
+}
+
+/*
+ ** Daemon mode
+ **
+ ** A process listening on a Unix socket keeps the indexes built
+ ** and formats the requests of clients (--connect) with a pool of
+ ** threads, each one reusing its output buffer. A request is the
+ ** header, the full path of the custom dialect (if any), and the
+ ** data; the reply is the header, a message, and the output. Both
+ ** sides are the same program, so structures are sent as they are.
+ */
+#define DAEMON_MAGIC    "P6502D01"
+#define DAEMON_MAX_SIZE 268435456ULL    /* Bigger inputs are formatted by the client */
+#define DAEMON_TIMEOUT  10      /* Seconds waiting for a client */
+
+struct request {
+    char magic[8];
+    struct pretty6502_options options;  /* Without dialect */
+    unsigned long long first;
+    unsigned long long last;
+    unsigned long long dialect_length;
+    unsigned long long size;
+};
+
+struct reply {
+    char magic[8];
+    int error;
+    int message_length;
+    unsigned long long size;
+};
+
+/*
+ ** Dialects already loaded by the daemon
+ */
+struct loaded_dialect {
+    char *name;
+    struct stat info;
+    struct pretty6502_dialect *dialect;
+    struct loaded_dialect *next;
+};
+
+struct loaded_dialect *loaded_dialects;
+pthread_mutex_t dialect_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ ** Read exactly length bytes, returns zero if successful
+ */
+int read_all(int fd, void *data, size_t length)
+{
+    char *p = data;
+    ssize_t got;
+    
+    while (length > 0) {
+        got = read(fd, p, length);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return 1;
+        p += got;
+        length -= got;
+    }
+    return 0;
+}
+
+/*
+ ** Connect to the daemon, returns -1 if not possible
+ */
+int connect_daemon(char *name)
+{
+    struct sockaddr_un address;
+    int fd;
+    
+    if (strlen(name) >= sizeof(address.sun_path))
+        return -1;
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, name);
+    if (connect(fd, (struct sockaddr *) &address, sizeof(address)) != 0) {
+        close(fd);
+        return -1;
     }
-    fseek(input, 0, SEEK_SET);
-    if (fread(data, sizeof(char), allocation, input) != allocation) {
-        fprintf(stderr, "Something went wrong reading the input file\n");
-        fclose(input);
-        free(data);
-        exit(1);
+    return fd;
+}
+
+/*
+ ** Format through the daemon
+ **
+ ** If the daemon cannot be reached (or fails before answering) the
+ ** data is formatted here, so a client never fails because of it.
+ */
+int remote_format(struct pretty6502_options *options, char *data, size_t size, size_t first, size_t last, pretty6502_sink sink, void *context)
+{
+    struct request request;
+    struct reply reply;
+    char message[256];
+    char *result;
+    int error;
+    int fd;
+    
+    fd = size <= DAEMON_MAX_SIZE ? connect_daemon(daemon_socket) : -1;
+    if (fd < 0)
+        return pretty6502_format_lines(options, data, size, first, last, sink, context);
+    memset(&request, 0, sizeof(request));
+    memcpy(request.magic, DAEMON_MAGIC, sizeof(request.magic));
+    request.options = *options;
+    request.options.dialect = NULL;
+    request.first = first;
+    request.last = last;
+    request.dialect_length = options->dialect != NULL ? strlen(dialect_name) : 0;
+    request.size = size;
+    result = NULL;
+    if (write_data(fd, (char *) &request, sizeof(request))
+    || write_data(fd, dialect_name, request.dialect_length)
+    || write_data(fd, data, size)
+    || read_all(fd, &reply, sizeof(reply))
+    || memcmp(reply.magic, DAEMON_MAGIC, sizeof(reply.magic)) != 0
+    || reply.message_length < 0 || reply.message_length >= (int) sizeof(message)
+    || read_all(fd, message, reply.message_length)
+    || (result = malloc(reply.size + 1)) == NULL
+    || read_all(fd, result, reply.size)) {
+        close(fd);
+        free(result);
+        return pretty6502_format_lines(options, data, size, first, last, sink, context);
     }
-    fclose(input);
+    close(fd);
+    if (reply.error) {  /* Same failures as formatting here */
+        message[reply.message_length] = '\0';
+        if (message[0] != '\0')
+            fprintf(stderr, "%s\n", message);
+        free(result);
+        return 1;
+    }
+    error = reply.size != 0 ? sink(context, result, reply.size) : 0;
+    free(result);
+    return error;
+}
+
+/*
+ ** Get a dialect for a request, loading it only once
+ */
+struct pretty6502_dialect *daemon_dialect(char *name, char *message)
+{
+    struct loaded_dialect *loaded;
+    struct stat info;
     
-    /*
-     ** Ease processing of input file
-     */
-    request = 0;
-    p1 = data;
-    p2 = data;
-    while (p1 < data + allocation) {
-        if (*p1 == '\r') {	/* Ignore \r characters */
-            p1++;
-            continue;
-        }
-        if (*p1 == '\n') {
-            p1++;
-            
-            /* Remove trailing spaces */
-            while (p2 > data && *(p2 - 1) != '\0' && isspace(*(p2 - 1)))
-                p2--;
-            *p2++ = '\0';	/* Break line */
-            request = 1;
-            continue;
+    if (stat(name, &info) != 0) {
+        sprintf(message, "Unable to open index file: %.200s", name);
+        return NULL;
+    }
+    pthread_mutex_lock(&dialect_mutex);
+    for (loaded = loaded_dialects; loaded != NULL; loaded = loaded->next) {
+        if (strcmp(loaded->name, name) == 0 && loaded->info.st_dev == info.st_dev
+        && loaded->info.st_ino == info.st_ino && loaded->info.st_size == info.st_size
+        && loaded->info.st_mtime == info.st_mtime)
+            break;
+    }
+    if (loaded == NULL) {   /* Old versions are kept, a request could be using them */
+        loaded = malloc(sizeof(struct loaded_dialect));
+        if (loaded != NULL) {
+            loaded->name = strdup(name);
+            loaded->info = info;
+            loaded->dialect = pretty6502_load_dialect(name, message);
+            if (loaded->name == NULL || loaded->dialect == NULL) {
+                free(loaded->name);
+                free(loaded);
+                loaded = NULL;
+            } else {
+                loaded->next = loaded_dialects;
+                loaded_dialects = loaded;
+            }
+        } else {
+            sprintf(message, "Unable to allocate memory");
         }
-        *p2++ = *p1++;
-        request = 0;
     }
-    if (request == 0)
-        *p2++ = '\0';	/* Force line break */
-    allocation = p2 - data;
+    pthread_mutex_unlock(&dialect_mutex);
+    return loaded != NULL ? loaded->dialect : NULL;
+}
+
+/*
+ ** Send the reply to a request, the output is sent if there is no error
+ */
+void daemon_reply(int fd, struct reply *reply, char *message, char *output)
+{
+    memcpy(reply->magic, DAEMON_MAGIC, sizeof(reply->magic));
+    reply->message_length = strlen(message);
+    if (reply->error)
+        reply->size = 0;
+    if (write_data(fd, (char *) reply, sizeof(*reply)) == 0
+    && write_data(fd, message, reply->message_length) == 0)
+        write_data(fd, output, reply->size);
+}
+
+/*
+ ** Answer a request
+ */
+void daemon_request(int fd, struct memory_sink *memory)
+{
+    struct request request;
+    struct reply reply;
+    struct input_file input;
+    char message[256];
+    char name[4096];
     
-    /*
-     ** Now generate output file
-     */
-    c++;
-    output = fopen(argv[c], "w");
-    if (output == NULL) {
-        fprintf(stderr, "Unable to open output file: %s\n", argv[c]);
-        exit(1);
+    if (read_all(fd, &request, sizeof(request))
+    || memcmp(request.magic, DAEMON_MAGIC, sizeof(request.magic)) != 0
+    || request.dialect_length >= sizeof(name)
+    || read_all(fd, name, request.dialect_length))
+        return;
+    name[request.dialect_length] = '\0';
+    request.options.dialect = NULL; /* A pointer of the client means nothing here */
+    message[0] = '\0';
+    memory->used = 0;
+    reply.error = 0;
+    if (request.size > DAEMON_MAX_SIZE) {
+        sprintf(message, "Input too big for the daemon");
+        reply.error = 1;
+    } else if (request.first < 1 || request.first > request.last) {
+        sprintf(message, "Bad line range: %llu-%llu", request.first, request.last);
+        reply.error = 1;
     }
-    prev_comment_original_location = 0;
-    prev_comment_final_location = 0;
-    current_level = 0;
-    p = data;
-    while (p < data + allocation) {
-        something = 0;
-        current_column = 0;
-        p1 = p;
-        p2 = p1;
-        
-        while (*p2 && !isspace(*p2) && !comment_present(p, p2, 1)) {
-            p2++;
+    if (reply.error) {
+        daemon_reply(fd, &reply, message, NULL);
+        return;
+    }
+    input.data = malloc(request.size + 1);
+    if (input.data == NULL || read_all(fd, input.data, request.size)) {
+        free(input.data);
+        return;
+    }
+    if (request.dialect_length != 0) {
+        request.options.dialect = daemon_dialect(name, message);
+        if (request.options.dialect == NULL)
+            reply.error = 1;
+    }
+    if (!reply.error && pretty6502_check(&request.options, message))
+        reply.error = 1;
+    if (!reply.error && pretty6502_format_lines(&request.options, input.data, request.size, request.first, request.last, write_memory, memory)) {
+        sprintf(message, "Unable to allocate memory");
+        reply.error = 1;
+    }
+    free(input.data);
+    reply.size = memory->used;
+    daemon_reply(fd, &reply, message, memory->data);
+    if (memory->size > 16 * 1048576) {  /* Don't keep huge buffers */
+        free(memory->data);
+        memory->data = NULL;
+        memory->size = 0;
+    }
+}
+
+/*
+ ** Thread of the daemon
+ **
+ ** Sockets have a timeout, so idle clients cannot keep the threads.
+ */
+void *daemon_worker(void *arg)
+{
+    struct memory_sink memory;
+    struct timeval timeout;
+    int listener = *(int *) arg;
+    int fd;
+    
+    timeout.tv_sec = DAEMON_TIMEOUT;
+    timeout.tv_usec = 0;
+    memory.data = NULL;
+    memory.size = 0;
+    memory.used = 0;
+    while (1) {
+        fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
         }
-        if (p2 - p1) {	/* Label */
-            something = 1;
-            fwrite(p1, sizeof(char), p2 - p1, output);
-            current_column = p2 - p1;
-            p1 = p2;
-        } else {
-            current_column = 0;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        daemon_request(fd, &memory);
+        close(fd);
+    }
+    free(memory.data);
+    return NULL;
+}
+
+/*
+ ** Run as daemon, only returns on error
+ */
+int daemon_mode(char *name, int jobs)
+{
+    struct sockaddr_un address;
+    struct stat info;
+    pthread_t *threads;
+    int listener;
+    int c;
+    
+    if (strlen(name) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket name too long: %s\n", name);
+        return 1;
+    }
+    if (jobs <= 0)
+        jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (jobs <= 0)
+        jobs = 1;
+    signal(SIGPIPE, SIG_IGN);
+    pthread_once(&keyword_index_once, build_indexes);
+    if (lstat(name, &info) == 0 && S_ISSOCK(info.st_mode))
+        unlink(name);   /* Left by a previous daemon */
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, name);
+    if (listener < 0 || bind(listener, (struct sockaddr *) &address, sizeof(address)) != 0 || listen(listener, 128) != 0) {
+        fprintf(stderr, "Unable to listen on socket: %s\n", name);
+        return 1;
+    }
+    threads = malloc(jobs * sizeof(pthread_t));
+    if (threads == NULL) {
+        fprintf(stderr, "Unable to allocate memory\n");
+        return 1;
+    }
+    for (c = 0; c < jobs; c++) {
+        if (pthread_create(&threads[c], NULL, daemon_worker, &listener) != 0) {
+            fprintf(stderr, "Unable to create thread\n");
+            return 1;
         }
-        while (*p1 && isspace(*p1) && !comment_present(p, p1, 1))
-            p1++;
-        indent = current_level * nesting_space;
-        flags = 0;
-        if (*p1 && !comment_present(p, p1, 1)) {	/* Mnemonic */
-            p2 = p1;
-            while (*p2 && !isspace(*p2) && !comment_present(p, p2, 0))
-                p2++;
-            if (processor != P_UNK) {   /* The processor is defined */
-                c = check_opcode(p1, p2);
-                if (c == 0) {   /* No match */
-                    request = start_mnemonic;
-                } else if (c < 0) { /* Mnemonic */
-                    request = start_mnemonic;
-                } else {    /* Directive */
-                    if (processor == P_6502)
-                        flags = directives_dasm[c - 1].flags;
-                    else if (processor == P_Z80)
-                        flags = directives_tniasm[c - 1].flags;
-                    else if (processor == P_CP1610)
-                        flags = directives_as1600[c - 1].flags;
-                    else if (processor == P_TMS9900)
-                        flags = directives_xas99[c - 1].flags;
-                    else if (processor == P_8086)
-                        flags = directives_nasm[c - 1].flags;
-                    else if (processor == P_65C02)
-                        flags = directives_ca65[c - 1].flags;
-                    else if (processor == P_6502_GASM80)
-                        flags = directives_gasm80[c - 1].flags;
-                    else if (processor == P_Z80_GASM80)
-                        flags = directives_gasm80[c - 1].flags;
-                    if (flags & DONT_RELOCATE_LABEL)
-                        request = start_operand;
-                    else
-                        request = start_mnemonic;
-                }
-            } else {
-                request = start_mnemonic;
-                c = 0;
+    }
+    for (c = 0; c < jobs; c++)
+        pthread_join(threads[c], NULL);
+    fprintf(stderr, "Unable to accept connections on socket: %s\n", name);
+    return 1;
+}
+
+/*
+ ** Parse a line range (A-B, A-, or A), returns zero if valid
+ */
+int parse_range(char *p)
+{
+    char *p2;
+    
+    first_line = strtoul(p, &p2, 10);
+    if (p2 == p || first_line < 1)
+        return 1;
+    if (*p2 == '\0') {
+        last_line = first_line;
+        return 0;
+    }
+    if (*p2++ != '-')
+        return 1;
+    if (*p2 == '\0') {
+        last_line = (size_t) -1;
+        return 0;
+    }
+    p = p2;
+    last_line = strtoul(p, &p2, 10);
+    if (p2 == p || *p2 != '\0' || last_line < first_line)
+        return 1;
+    return 0;
+}
+
+/*
+ ** Show usage
+ */
+void usage(void)
+{
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Pretty6502 " VERSION " by Oscar Toledo G. http://nanochess.org/\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Usage:\n");
+    fprintf(stderr, "    pretty6502 [args] input.asm output.asm\n");
+    fprintf(stderr, "    pretty6502 [args] --tokens=tokens.bin input.asm [output.asm]\n");
+    fprintf(stderr, "    pretty6502 [args] --xref=xref.bin input.asm [output.asm]\n");
+    fprintf(stderr, "    pretty6502 [args] --variant=-s1,-t8:book.asm input.asm [output.asm]\n");
+    fprintf(stderr, "    pretty6502 [args] --batch file_or_directory...\n");
+    fprintf(stderr, "    pretty6502 [args] --check file_or_directory...\n");
+    fprintf(stderr, "    pretty6502 [args] --diff file_or_directory...\n");
+    fprintf(stderr, "    pretty6502 [args] --follow main.asm...\n");
+    fprintf(stderr, "    pretty6502 [args] --watch file_or_directory...\n");
+    fprintf(stderr, "    pretty6502 --compile-dialect dialect.txt dialect.idx\n");
+    fprintf(stderr, "    pretty6502 [--jobs=4] --daemon=socket\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Use - as input.asm for standard input, and - as output.asm\n");
+    fprintf(stderr, "for standard output.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "It's recommended to not use same output file as input,\n");
+    fprintf(stderr, "even if possible because there is a chance (0.0000001%%)\n");
+    fprintf(stderr, "that you can DAMAGE YOUR SOURCE if Pretty6502 has\n");
+    fprintf(stderr, "undiscovered bugs. Anyway the file is only replaced\n");
+    fprintf(stderr, "(atomically) if the formatting changes it.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Arguments:\n");
+    fprintf(stderr, "    -s0       Code in four columns (default)\n");
+    fprintf(stderr, "              label: mnemonic operand comment\n");
+    fprintf(stderr, "    -s1       Code in three columns\n");
+    fprintf(stderr, "              label: mnemonic+operand comment\n");
+    fprintf(stderr, "    -p0       Processor unknown\n");
+    fprintf(stderr, "    -p1       Processor 6502 + DASM syntax (default)\n");
+    fprintf(stderr, "    -p2       Processor Z80 + tniASM syntax\n");
+    fprintf(stderr, "    -p3       Processor CP1610 + as1600 syntax (Intellivision(tm))\n");
+    fprintf(stderr, "    -p4       Processor TMS9900 + xas99 syntax (TI-99/4A)\n");
+    fprintf(stderr, "    -p5       Processor 8086 + nasm syntax\n");
+    fprintf(stderr, "    -p6       Processor 65c02 + ca65 syntax\n");
+    fprintf(stderr, "    -p7       Processor 6502 + gasm80 syntax\n");
+    fprintf(stderr, "    -p8       Processor Z80 + gasm80 syntax\n");
+    fprintf(stderr, "    -n4       Nesting spacing (can be any number\n");
+    fprintf(stderr, "              of spaces or multiple of tab size)\n");
+    fprintf(stderr, "    -m8       Start of mnemonic column (default)\n");
+    fprintf(stderr, "    -o16      Start of operand column (default)\n");
+    fprintf(stderr, "    -c32      Start of comment column (default)\n");
+    fprintf(stderr, "    -t0       Use spaces to align (default)\n");
+    fprintf(stderr, "    -t8       Use tabs to reach column (size 8)\n");
+    fprintf(stderr, "              Options -m, -o, -c, and -n must be multiples of this value.\n");
+    fprintf(stderr, "    -a0       Align comments to nearest column\n");
+    fprintf(stderr, "    -a1       Comments at line start are aligned\n");
+    fprintf(stderr, "              to mnemonic (default)\n");
+    fprintf(stderr, "    -l        Puts labels in its own line\n");
+    fprintf(stderr, "    -dl       Change directives to lowercase\n");
+    fprintf(stderr, "    -du       Change directives to uppercase\n");
+    fprintf(stderr, "    -ml       Change mnemonics to lowercase\n");
+    fprintf(stderr, "    -mu       Change mnemonics to uppercase\n");
+    fprintf(stderr, "    --batch   Format in place every file and directory given\n");
+    fprintf(stderr, "    --follow  Same as --batch, also every file included by them\n");
+    fprintf(stderr, "              (it can be used with --check)\n");
+    fprintf(stderr, "    --watch   Keep formatting in place the files given (or inside\n");
+    fprintf(stderr, "              the directories given) each time they are saved\n");
+    fprintf(stderr, "    --files0-from=list\n");
+    fprintf(stderr, "              Batch names come from list (NUL-separated, - for stdin)\n");
+    fprintf(stderr, "    --jobs=4  Number of threads for batch mode, or for a big\n");
+    fprintf(stderr, "              file (default all cores)\n");
+    fprintf(stderr, "    --max-memory=%d\n", BATCH_MEMORY);
+    fprintf(stderr, "              Memory limit in megabytes for files in flight\n");
+    fprintf(stderr, "    --check   Only check the files and directories given are\n");
+    fprintf(stderr, "              formatted, nothing is written (exit code 2 if not)\n");
+    fprintf(stderr, "    --diff    Same as --check, but the changes are written to\n");
+    fprintf(stderr, "              standard output as unified diff\n");
+    fprintf(stderr, "    --cache=file\n");
+    fprintf(stderr, "              Remember formatted files to skip them next time\n");
+    fprintf(stderr, "    --lines=10-20\n");
+    fprintf(stderr, "              Output only this range of lines (formatted as part\n");
+    fprintf(stderr, "              of the whole file)\n");
+    fprintf(stderr, "    --dialect=dialect.idx\n");
+    fprintf(stderr, "              Use a custom dialect instead of processor\n");
+    fprintf(stderr, "    --tokens=tokens.bin\n");
+    fprintf(stderr, "              Also write the fields of each line as binary records\n");
+    fprintf(stderr, "    --xref=xref.bin\n");
+    fprintf(stderr, "              Also write the labels with the lines using them\n");
+    fprintf(stderr, "    --variant=-s1,-t8:book.asm\n");
+    fprintf(stderr, "              Also write the input with other options (repeatable)\n");
+    fprintf(stderr, "    --stats   Report times of each phase, speed, and memory used\n");
+    fprintf(stderr, "              (--stats=json in JSON format)\n");
+    fprintf(stderr, "    --connect=socket\n");
+    fprintf(stderr, "              Format through the daemon listening on socket\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Assumes all your labels are at start of line and there is space\n");
+    fprintf(stderr, "before mnemonic.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Accepts any assembler file where ; means comment\n");
+    fprintf(stderr, "[label] mnemonic [operand] ; comment\n");
+    exit(1);
+}
+
+/*
+ ** Process a short option (as -s1) into options
+ */
+void short_option(struct pretty6502_options *options, char *arg, int *operand)
+{
+    int processor;
+    
+    switch (tolower(arg[1])) {
+        case 's':	/* Style */
+            options->style = atoi(&arg[2]);
+            if (options->style != 0 && options->style != 1) {
+                fprintf(stderr, "Bad style code: %d\n", options->style);
+                exit(1);
             }
-            if (c <= 0) {   /* Mnemonic or unknown */
-                if (mnemonics_case == 1) {
-                    p3 = p1;
-                    while (p3 < p2) {
-                        *p3 = tolower(*p3);
-                        p3++;
-                    }
-                } else if (mnemonics_case == 2) {
-                    p3 = p1;
-                    while (p3 < p2) {
-                        *p3 = toupper(*p3);
-                        p3++;
-                    }
-                }
-            } else {    /* Directive */
-                if (directives_case == 1) {
-                    p3 = p1;
-                    while (p3 < p2) {
-                        *p3 = tolower(*p3);
-                        p3++;
-                    }
-                } else if (directives_case == 2) {
-                    p3 = p1;
-                    while (p3 < p2) {
-                        *p3 = toupper(*p3);
-                        p3++;
-                    }
-                }
+            break;
+        case 'p':	/* Processor */
+            processor = atoi(&arg[2]);
+            if (processor < 0 || processor >= P_UNSUPPORTED) {
+                fprintf(stderr, "Bad processor code: %d\n", processor);
+                exit(1);
             }
-            
-            /*
-             ** Move label to own line
-             */ 
-            if (current_column != 0 && labels_own_line != 0 && (flags & DONT_RELOCATE_LABEL) == 0) {
-                fputc('\n', output);
-                current_column = 0;
+            options->processor = processor;
+            break;
+        case 'm':	/* Mnemonic start */
+            if (tolower(arg[2]) == 'l') {
+                options->mnemonics_case = 1;
+            } else if (tolower(arg[2]) == 'u') {
+                options->mnemonics_case = 2;
+            } else {
+                options->start_mnemonic = atoi(&arg[2]);
             }
-            if (flags & LEVEL_OUT) {    /* Directive, exits nested level */
-                if (current_level > 0) {
-                    current_level--;
-                    indent -= nesting_space;
-                }
+            break;
+        case 'o':	/* Operand start */
+            options->start_operand = atoi(&arg[2]);
+            *operand = 1;
+            break;
+        case 'c':	/* Comment start */
+            options->start_comment = atoi(&arg[2]);
+            break;
+        case 't':	/* Tab size */
+            options->tabs = atoi(&arg[2]);
+            break;
+        case 'a':	/* Comment alignment */
+            options->align_comment = atoi(&arg[2]);
+            if (options->align_comment != 0 && options->align_comment != 1) {
+                fprintf(stderr, "Bad comment alignment: %d\n", options->align_comment);
+                exit(1);
             }
-            if (flags & LEVEL_MINUS) {  /* Directive, enters nested level */
-                if (indent >= nesting_space)
-                    indent -= nesting_space;
-                else
-                    indent = 0;
+            break;
+        case 'n':	/* Nesting space */
+            options->nesting_space = atoi(&arg[2]);
+            break;
+        case 'l':	/* Labels in own line */
+            options->labels_own_line = 1;
+            break;
+        case 'd':	/* Directives */
+            if (tolower(arg[2]) == 'l') {
+                options->directives_case = 1;
+            } else if (tolower(arg[2]) == 'u') {
+                options->directives_case = 2;
+            } else {
+                fprintf(stderr, "Unknown argument: %c%c\n", arg[1], arg[2]);
             }
-            request += indent;
-            request_space(output, &current_column, request, 1);
-            something = 1;
-            fwrite(p1, sizeof(char), p2 - p1, output);
-            current_column += p2 - p1;
-            p1 = p2;
-            while (*p1 && isspace(*p1) && !comment_present(p, p1, 0))
-                p1++;
-            if (*p1 && !comment_present(p, p1, 0)) {	/* Operand */
-                if (processor == P_TMS9900)
-                    request = current_column + 1;
+            break;
+        default:	/* Other */
+            fprintf(stderr, "Unknown argument: %c\n", arg[1]);
+            exit(1);
+    }
+}
+
+/*
+ ** Process the options of a variant (as -s1,-t8,-mu), the processor
+ ** cannot change
+ */
+void list_variant(struct pretty6502_options *options, char *list)
+{
+    char *p;
+    int operand;
+    
+    for (p = strtok(list, ","); p != NULL; p = strtok(NULL, ",")) {
+        if (p[0] != '-' || p[1] == '\0' || p[1] == '-') {
+            fprintf(stderr, "Bad variant option: %s\n", p);
+            exit(1);
+        }
+        if (tolower(p[1]) == 'p') {
+            fprintf(stderr, "A variant cannot change the processor: %s\n", p);
+            exit(1);
+        }
+        short_option(options, p, &operand);
+    }
+}
+
+/*
+ ** Main program
+ */
+int main(int argc, char *argv[])
+{
+    int c;
+    int request;
+    int something;
+    int batch;
+    int watch;
+    int jobs;
+    int memory;
+    int compile;
+    char *daemon_name;
+    char *list;
+    char message[256];
+    struct stat info;
+    int input;
+    struct pretty6502_options options;
+    char *p;
+    
+    /*
+     ** Default settings
+     */
+    pretty6502_defaults(&options);
+    pthread_once(&keyword_index_once, build_indexes);  /* Also case tables for names of files */
+    batch = 0;
+    watch = 0;
+    jobs = 0;
+    memory = BATCH_MEMORY;
+    compile = 0;
+    daemon_name = NULL;
+    list = NULL;
+    
+    /*
+     ** Process arguments
+     */
+    something = 0;
+    c = 1;
+    while (c < argc && argv[c][0] == '-' && argv[c][1] != '\0') {
+        if (argv[c][1] == '-') {    /* Long options */
+            if (strcmp(argv[c], "--batch") == 0) {
+                batch = 1;
+            } else if (strcmp(argv[c], "--follow") == 0) {
+                batch = 1;
+                follow_includes = 1;
+            } else if (strcmp(argv[c], "--diff") == 0) {
+                batch = 1;
+                check_mode = 1;
+                diff_mode = 1;
+            } else if (strcmp(argv[c], "--watch") == 0) {
+                watch = 1;
+            } else if (strcmp(argv[c], "--check") == 0) {
+                batch = 1;
+                check_mode = 1;
+            } else if (memcmp(argv[c], "--files0-from=", 14) == 0) {
+                batch = 1;
+                list = &argv[c][14];
+            } else if (memcmp(argv[c], "--jobs=", 7) == 0) {
+                jobs = atoi(&argv[c][7]);
+            } else if (memcmp(argv[c], "--cache=", 8) == 0) {
+                if (cache_open(&argv[c][8]))
+                    fprintf(stderr, "Warning: cannot use cache file %s\n", &argv[c][8]);
+            } else if (strcmp(argv[c], "--compile-dialect") == 0) {
+                compile = 1;
+            } else if (memcmp(argv[c], "--dialect=", 10) == 0) {
+                options.dialect = pretty6502_load_dialect(&argv[c][10], message);
+                if (options.dialect == NULL) {
+                    fprintf(stderr, "%s\n", message);
+                    exit(1);
+                }
+                dialect_name = realpath(&argv[c][10], NULL);
+                if (dialect_name == NULL) {
+                    fprintf(stderr, "Unable to allocate memory\n");
+                    exit(1);
+                }
+            } else if (memcmp(argv[c], "--daemon=", 9) == 0) {
+                daemon_name = &argv[c][9];
+            } else if (memcmp(argv[c], "--connect=", 10) == 0) {
+                daemon_socket = &argv[c][10];
+                signal(SIGPIPE, SIG_IGN);
+            } else if (memcmp(argv[c], "--tokens=", 9) == 0) {
+                tokens_name = &argv[c][9];
+            } else if (memcmp(argv[c], "--xref=", 7) == 0) {
+                xref_name = &argv[c][7];
+            } else if (memcmp(argv[c], "--variant=", 10) == 0) {
+                variant_names = realloc(variant_names, (variant_count + 1) * sizeof(char *));
+                if (variant_names == NULL) {
+                    fprintf(stderr, "Unable to allocate memory\n");
+                    exit(1);
+                }
+                variant_names[variant_count++] = &argv[c][10];
+            } else if (strcmp(argv[c], "--stats") == 0) {
+                stats_mode = 1;
+            } else if (strcmp(argv[c], "--stats=json") == 0) {
+                stats_mode = 2;
+            } else if (memcmp(argv[c], "--max-memory=", 13) == 0) {
+                memory = atoi(&argv[c][13]);
+            } else if (strcmp(argv[c], "--lines") == 0 || memcmp(argv[c], "--lines=", 8) == 0) {
+                if (argv[c][7] == '=')
+                    p = &argv[c][8];
+                else if (c + 1 < argc)
+                    p = argv[++c];
                 else
-                    request = start_operand + indent;
-                request_space(output, &current_column, request, 1);
-                p2 = p1;
-                while (*p2 && !comment_present(p, p2, 0)) {
-                    if (*p2 == '"') {
-                        p2++;
-                        while (*p2 && *p2 != '"') {
-                            if (*p2 == '\\' && *(p2 + 1) == '"')
-                                p2++;
-                            p2++;
-                        }
-                        p2++;
-                    } else if (*p2 == '\'') {
-                        p2++;
-                        if (p2 - p1 < 6 || memcmp(p2 - 6, "AF,AF'", 6) != 0) {
-                            while (*p2 && *p2 != '\'') {
-                                if (*p2 == '\\' && *(p2 + 1) == '\'')
-                                    p2++;
-                                p2++;
-                            }
-                            p2++;
-                        }
-                    } else {
-                        p2++;
-                    }
+                    p = "";
+                if (parse_range(p)) {
+                    fprintf(stderr, "Bad line range: %s\n", p);
+                    exit(1);
                 }
-                while (p2 > p1 && isspace(*(p2 - 1)))
-                    p2--;
-                something = 1;
-                fwrite(p1, sizeof(char), p2 - p1, output);
-                current_column += p2 - p1;
-                p1 = p2;
-                while (*p1 && isspace(*p1) && !comment_present(p, p1, 0))
-                    p1++;
-            }
-            if (flags & LEVEL_IN) {
-                current_level++;
+            } else {
+                fprintf(stderr, "Unknown argument: %s\n", argv[c]);
+                exit(1);
             }
+            c++;
+            continue;
+        }
+        short_option(&options, argv[c], &something);
+        c++;
+    }
+    
+    if (daemon_name != NULL)
+        exit(daemon_mode(daemon_name, jobs));
+    if (compile) {
+        if (argc - c != 2)
+            usage();
+        if (pretty6502_compile_dialect(argv[c], argv[c + 1], message)) {
+            fprintf(stderr, "%s\n", message);
+            exit(1);
+        }
+        exit(0);
+    }
+    
+    /*
+     ** Validate constraints
+     */
+    if (pretty6502_check(&options, message)) {
+        fprintf(stderr, "%s\n", message);
+        exit(1);
+    }
+    if (something && options.processor == P_TMS9900) {
+        fprintf(stderr, "Warning: ignoring operand column, not possible because you selected TMS9900 mode\n");
+    }
+    
+    /*
+     ** Variants start from the main options
+     */
+    if (variant_count != 0) {
+        if (first_line != 1 || last_line != (size_t) -1) {
+            fprintf(stderr, "Line range cannot be used with variants\n");
+            exit(1);
         }
-        if (comment_present(p, p1, !something)) {	/* Comment */
-            if (processor == P_TMS9900) {
-                while (isspace(*p1))
-                    p1++;
+        variant_options = malloc(variant_count * sizeof(struct pretty6502_options));
+        if (variant_options == NULL) {
+            fprintf(stderr, "Unable to allocate memory\n");
+            exit(1);
+        }
+        for (request = 0; request < variant_count; request++) {
+            variant_options[request] = options;
+            p = strchr(variant_names[request], ':');
+            if (p == NULL || p[1] == '\0') {
+                fprintf(stderr, "Bad variant (options:output): %s\n", variant_names[request]);
+                exit(1);
             }
-            
-            /*
-             ** Try to keep comments aligned vertically (only works
-             ** if spaces were used in source file)
-             */
-            p2 = p1;
-            while (p2 - 1 >= p && isspace(*(p2 - 1)))
-                p2--;
-            if (processor == P_TMS9900 && p2 == p && *p1 == '*') {
-                request = 0;    /* Cannot be other */
-            } else if (p2 == p && p1 - p == prev_comment_original_location) {
-                request = prev_comment_final_location;
-            } else {
-                prev_comment_original_location = p1 - p;
-                if (current_column == 0)
-                    request = 0;
-                else if (current_column < start_mnemonic + indent)
-                    request = start_mnemonic + indent;
-                else
-                    request = start_comment + indent;
-                if (current_column == 0 && align_comment == 1)
-                    request = start_mnemonic + indent;
-                prev_comment_final_location = request;
+            *p = '\0';
+            list_variant(&variant_options[request], variant_names[request]);
+            variant_names[request] = p + 1;
+            if (pretty6502_check(&variant_options[request], message)) {
+                fprintf(stderr, "%s\n", message);
+                exit(1);
             }
-            request_space(output, &current_column, request, (*p1 == ';') ? 0 : 2);
-            p2 = p1;
-            while (*p2)
-                p2++;
-            while (p2 > p1 && isspace(*(p2 - 1)))
-                p2--;
-            fwrite(p1, sizeof(char), p2 - p1, output);
-            current_column += p2 - p1;
-        } else if (something == 0) {
-            prev_comment_original_location = 0;
-            prev_comment_final_location = 0;
         }
-        fputc('\n', output);
-        while (*p++) ;
     }
-    fclose(output);	
-    free(data);
+    
+    if (stats_mode) {
+        stats_start = clock_nanoseconds();
+        atexit(stats_report);
+    }
+    if (watch) {
+        if (c == argc)
+            usage();
+        if (batch || first_line != 1 || last_line != (size_t) -1 || tokens_name != NULL || xref_name != NULL || variant_count != 0) {
+            fprintf(stderr, "Watch mode only formats files in place\n");
+            exit(1);
+        }
+        exit(watch_mode(&options, argc - c, argv + c));
+    }
+    if (batch) {
+        if (c == argc && list == NULL)
+            usage();
+        if (first_line != 1 || last_line != (size_t) -1) {
+            fprintf(stderr, "Line range cannot be used in batch mode\n");
+            exit(1);
+        }
+        if (tokens_name != NULL) {
+            fprintf(stderr, "Token stream cannot be used in batch mode\n");
+            exit(1);
+        }
+        if (xref_name != NULL) {
+            fprintf(stderr, "Cross-reference cannot be used in batch mode\n");
+            exit(1);
+        }
+        if (variant_count != 0) {
+            fprintf(stderr, "Variants cannot be used in batch mode\n");
+            exit(1);
+        }
+        exit(batch_mode(&options, argc - c, argv + c, list, jobs, memory));
+    }
+    if (argc - c != 2 && (argc - c != 1 || (tokens_name == NULL && xref_name == NULL && variant_count == 0))) {
+        if (argc < 3)   /* Program name counts as one */
+            usage();
+        fprintf(stderr, "Bad argument\n");
+        exit(1);
+    }
+    if (strcmp(argv[c], "-") == 0 && daemon_socket == NULL && tokens_name == NULL && xref_name == NULL && variant_count == 0) {
+        request = stream_file(&options, 0, argv[c + 1], message);
+        stats_add(&stats_busy, clock_nanoseconds() - stats_start);
+        if (request) {
+            fprintf(stderr, "%s\n", message);
+            exit(1);
+        }
+        exit(0);
+    }
+    if (daemon_socket == NULL && tokens_name == NULL && xref_name == NULL && variant_count == 0 && stat(argv[c], &info) == 0 && !S_ISREG(info.st_mode)) {   /* Pipe or device */
+        fprintf(stderr, "Processing %s...\n", argv[c]);
+        input = open(argv[c], O_RDONLY);
+        if (input < 0) {
+            fprintf(stderr, "Unable to open input file: %s\n", argv[c]);
+            exit(1);
+        }
+        request = stream_file(&options, input, argv[c + 1], message);
+        stats_add(&stats_busy, clock_nanoseconds() - stats_start);
+        close(input);
+        if (request) {
+            fprintf(stderr, "%s\n", message);
+            exit(1);
+        }
+        exit(0);
+    }
+    if (strcmp(argv[c], "-") != 0)
+        fprintf(stderr, "Processing %s...\n", argv[c]);
+    if (jobs <= 0)
+        jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    request = process_file(&options, argv[c], c + 1 < argc ? argv[c + 1] : NULL, jobs, message);
+    stats_add(&stats_busy, clock_nanoseconds() - stats_start);
+    if (request) {
+        fprintf(stderr, "%s\n", message);
+        exit(1);
+    }
     exit(0);
 }
+
+#endif
@@ -0,0 +1,240 @@
+/*
+ ** Pretty6502 library
+ **
+ ** by Oscar Toledo G.
+ **
+ ** © Copyright 2017-2026 Oscar Toledo G.
+ **
+ ** Creation date: Oct/17/2026. Formatter available as a reentrant library.
+ */
+
+#ifndef PRETTY6502_H
+#define PRETTY6502_H
+
+#include <stddef.h>
+
+#if defined(__GNUC__)
+#define PRETTY6502_API  __attribute__((visibility("default")))
+#else
+#define PRETTY6502_API
+#endif
+
+/*
+ ** Processor/assembler
+ */
+enum {
+    P_UNK,
+    P_6502,
+    P_Z80,
+    P_CP1610,
+    P_TMS9900,
+    P_8086,
+    P_65C02,
+    P_6502_GASM80,
+    P_Z80_GASM80,
+    P_UNSUPPORTED,
+};
+
+/*
+ ** Custom dialect (see pretty6502_load_dialect)
+ */
+struct pretty6502_dialect;
+
+/*
+ ** Formatting options (the same as command line arguments)
+ */
+struct pretty6502_options {
+    int style;          /* Code style (0 = four columns, 1 = three columns) */
+    int processor;      /* Processor/assembler being used (P_UNK to P_Z80_GASM80) */
+    int start_mnemonic; /* Start of mnemonic column */
+    int start_operand;  /* Start of operand column */
+    int start_comment;  /* Start of comment column */
+    int tabs;           /* Size of tabs (0 to use spaces) */
+    int align_comment;  /* Align comments at line start to mnemonic */
+    int nesting_space;  /* Spaces per nesting level */
+    int labels_own_line;    /* Put labels in its own line */
+    int mnemonics_case; /* Case of mnemonics (0 = keep, 1 = lower, 2 = upper) */
+    int directives_case;    /* Case of directives (0 = keep, 1 = lower, 2 = upper) */
+    struct pretty6502_dialect *dialect; /* Custom dialect used instead of processor (or NULL) */
+};
+
+/*
+ ** Output sink, receives the formatted text in blocks.
+ ** Returns zero if successful, else formatting is aborted.
+ */
+typedef int (*pretty6502_sink)(void *context, char *data, size_t length);
+
+/*
+ ** Fill options with default settings
+ */
+PRETTY6502_API void pretty6502_defaults(struct pretty6502_options *options);
+
+/*
+ ** Validate options, returns zero if valid or else fills message
+ ** (at least 256 bytes). For three columns style the operand column
+ ** is adjusted.
+ */
+PRETTY6502_API int pretty6502_check(struct pretty6502_options *options, char *message);
+
+/*
+ ** Format the data buffer (it isn't modified), sending the result to
+ ** the sink. Returns zero if successful. Can be called at the same time
+ ** from several threads.
+ */
+PRETTY6502_API int pretty6502_format(struct pretty6502_options *options, char *data, size_t size, pretty6502_sink sink, void *context);
+
+/*
+ ** Format only the lines from first to last (counting from 1) of the
+ ** data buffer. The previous lines are processed without output to
+ ** know the nesting level and comment alignment at the first line.
+ */
+PRETTY6502_API int pretty6502_format_lines(struct pretty6502_options *options, char *data, size_t size, size_t first, size_t last, pretty6502_sink sink, void *context);
+
+/*
+ ** Format the data buffer into a new buffer (free it with free()),
+ ** the length of the result is stored in length. Returns NULL if
+ ** there isn't enough memory.
+ */
+PRETTY6502_API char *pretty6502_format_buffer(struct pretty6502_options *options, char *data, size_t size, size_t *length);
+
+/*
+ ** Callback receiving each line of the input (with its line break,
+ ** if any) and its formatted text (usually one line, two if the
+ ** label was moved to its own line). Returns zero to continue.
+ */
+typedef int (*pretty6502_line)(void *context, char *input, size_t input_length, char *output, size_t output_length);
+
+/*
+ ** Format the data buffer line by line, calling found for each
+ ** line. Returns zero if successful.
+ */
+PRETTY6502_API int pretty6502_format_each(struct pretty6502_options *options, char *data, size_t size, pretty6502_line found, void *context);
+
+/*
+ ** Same as pretty6502_format(), but a big buffer is split in parts
+ ** formatted by up to threads threads at the same time. The result
+ ** is the same.
+ */
+PRETTY6502_API int pretty6502_format_parallel(struct pretty6502_options *options, char *data, size_t size, int threads, pretty6502_sink sink, void *context);
+
+/*
+ ** Callback receiving the name of an included file, as it is
+ ** written in the operand without quotes (not ended with zero).
+ */
+typedef void (*pretty6502_include)(void *context, char *name, size_t length);
+
+/*
+ ** Report the files included by the data buffer (directives with the
+ ** include flag) in order. Returns zero if successful.
+ */
+PRETTY6502_API int pretty6502_includes(struct pretty6502_options *options, char *data, size_t size, pretty6502_include found, void *context);
+
+/*
+ ** Format the data buffer with several options (the same processor
+ ** or dialect, with other layout or case). The lines are split in
+ ** fields once, and each variant is written at the same time to its
+ ** own sink. Returns zero if successful.
+ */
+PRETTY6502_API int pretty6502_format_variants(struct pretty6502_options *options, int count, char *data, size_t size, pretty6502_sink *sinks, void **contexts);
+
+/*
+ ** Token stream (see pretty6502_tokens)
+ **
+ ** A header followed by one record per line, the number of records
+ ** comes from the size. Spans are byte offsets from the start of the
+ ** line in the input (a length of zero means the field is missing).
+ */
+#define PRETTY6502_TOKENS_MAGIC     "P6502TOK"
+#define PRETTY6502_TOKENS_VERSION   1   /* Also detects a different byte order */
+
+#define PRETTY6502_TOKEN_CR         0x80000000  /* Spans count without the \r of the line */
+
+struct pretty6502_token_header {
+    char magic[8];
+    unsigned int version;
+    unsigned int header_size;
+    unsigned int record_size;
+    int processor;      /* -1 for a custom dialect */
+};
+
+struct pretty6502_token {
+    unsigned long long offset;  /* Start of line in input */
+    unsigned int line;          /* Line number (from 1) */
+    unsigned int level;         /* Nesting level of line */
+    unsigned int label;
+    unsigned int label_length;
+    unsigned int mnemonic;
+    unsigned int mnemonic_length;
+    unsigned int operand;
+    unsigned int operand_length;
+    unsigned int comment;
+    unsigned int comment_length;
+    int keyword;                /* Positive directive, negative mnemonic, zero unknown */
+    unsigned int flags;         /* Directive flags, and PRETTY6502_TOKEN_CR */
+};
+
+/*
+ ** Split the data buffer in fields as the formatter does, sending
+ ** the token stream to the sink. Returns zero if successful.
+ */
+PRETTY6502_API int pretty6502_tokens(struct pretty6502_options *options, char *data, size_t size, pretty6502_sink sink, void *context);
+
+/*
+ ** Label cross-reference (see pretty6502_format_xref)
+ **
+ ** The header is followed by the symbols sorted by name, the lines
+ ** of the references of all the symbols, and the names (each one
+ ** ends in a zero byte).
+ */
+#define PRETTY6502_XREF_MAGIC       "P6502XRF"
+#define PRETTY6502_XREF_VERSION     1   /* Also detects a different byte order */
+
+#define PRETTY6502_XREF_EQUATE      0x01    /* Defined by a directive like equ, = or set */
+#define PRETTY6502_XREF_REDEFINED   0x02    /* Defined in more than one line */
+
+struct pretty6502_xref_header {
+    char magic[8];
+    unsigned int version;
+    unsigned int header_size;
+    unsigned int symbol_size;
+    unsigned int symbols;       /* Number of symbols */
+    unsigned int references;    /* Number of references */
+    unsigned int names_size;    /* Size of names */
+};
+
+struct pretty6502_xref_symbol {
+    unsigned int name;          /* Offset in names */
+    unsigned int length;        /* Length of name */
+    unsigned int line;          /* Line of first definition */
+    unsigned int flags;
+    unsigned int reference;     /* First one in the references */
+    unsigned int count;         /* Number of references */
+};
+
+/*
+ ** Format the data buffer as pretty6502_format() does, and in the
+ ** same pass find the labels defined and the operands that use them,
+ ** sending the cross-reference to xref_sink. The sink can be NULL to
+ ** only get the cross-reference. Returns zero if successful.
+ */
+PRETTY6502_API int pretty6502_format_xref(struct pretty6502_options *options, char *data, size_t size, pretty6502_sink sink, void *context, pretty6502_sink xref_sink, void *xref_context);
+
+/*
+ ** Compile a text dialect definition (mnemonics, directives with their
+ ** flags, and kind of comments) into an index file. Returns zero if
+ ** successful or else fills message.
+ */
+PRETTY6502_API int pretty6502_compile_dialect(char *source, char *target, char *message);
+
+/*
+ ** Load a compiled dialect index to use in options. It is mapped in
+ ** memory without parsing. Returns NULL and fills message on error.
+ */
+PRETTY6502_API struct pretty6502_dialect *pretty6502_load_dialect(char *name, char *message);
+
+/*
+ ** Release a loaded dialect
+ */
+PRETTY6502_API void pretty6502_free_dialect(struct pretty6502_dialect *dialect);
+
+#endif